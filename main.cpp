@@ -6,17 +6,40 @@
 #include <cmath>
 #include <ctime>
 #include <cstdlib>
+#include <cstring>
+#include <climits>
 #include <string>
 #include <stdio.h>
 #include <stdint.h>
 #include <vector>
 #include <deque>
+#include <queue>
 #include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <iomanip>
 #include <map>
+#include <set>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <random>
+#include <csignal>
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#ifndef __WINDOWS_MM__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "MidiFile.h"
 #include "RtMidi.h"
@@ -27,20 +50,70 @@ using namespace std;
 
 
 
-int errorStatus;
-bool unrecognizedChordTypes;
+// A set of pitch classes (bit 0 = C ... bit 11 = B) where every note carries a 2-bit brightness (0 = off, 1 = dim, 2 = bright)
+// The brightness is split across two bit planes so transposing, combining and comparing work on whole chords at once
+struct NoteSet
+{
+	uint16_t lowBits;
+	uint16_t highBits;
+
+	NoteSet() : lowBits(0), highBits(0) {}
+	NoteSet(uint16_t low, uint16_t high) : lowBits(low), highBits(high) {}
+
+	// every note that is lit, regardless of brightness
+	uint16_t mask() const
+	{
+		return lowBits | highBits;
+	}
+
+	bool empty() const
+	{
+		return mask() == 0;
+	}
+
+	// out-of-range note indices (eg. an unrecognized bass note) read as off and are never written
+	int brightness(int noteIndex) const
+	{
+		if (noteIndex < 0 || noteIndex >= 12) return 0;
+		return ((lowBits >> noteIndex) & 1) | (((highBits >> noteIndex) & 1) << 1);
+	}
+
+	void setBrightness(int noteIndex, int noteBrightness)
+	{
+		if (noteIndex < 0 || noteIndex >= 12) return;
+		uint16_t noteBit = 1 << noteIndex;
+		lowBits = (noteBrightness & 1) ? (lowBits | noteBit) : (lowBits & ~noteBit);
+		highBits = (noteBrightness & 2) ? (highBits | noteBit) : (highBits & ~noteBit);
+	}
+
+	bool operator==(const NoteSet& other) const
+	{
+		return lowBits == other.lowBits && highBits == other.highBits;
+	}
+
+	bool operator!=(const NoteSet& other) const
+	{
+		return !(*this == other);
+	}
+
+	// Orders note sets the same way their note strings sort, so maps keyed by NoteSet are written out in the same order as before
+	bool operator<(const NoteSet& other) const
+	{
+		uint16_t differentNotes = (lowBits ^ other.lowBits) | (highBits ^ other.highBits);
+		if (differentNotes == 0) return false;
+		int firstDifferentNote = __builtin_ctz(differentNotes);
+		return brightness(firstDifferentNote) < other.brightness(firstDifferentNote);
+	}
+};
 
-// Song info
-int beatsPerMinute = 0;
-int numBeats = 0;
 
-vector<string> chordProgression;
-vector<string> scaleProgression;
-vector<string> noteProgression;
+
+int errorStatus;
 
 const int UPDATE_CHANNEL_MESSAGE_CODE = 30;
 const int UPDATE_ALL_MESSAGE_CODE = 31;
 const int NOTES_PER_OCTAVE = 12;
+const uint16_t ALL_NOTES_MASK = (1 << NOTES_PER_OCTAVE) - 1;
 const int STARTING_OCTAVE = 3;
 const int ENDING_OCTAVE = 8;
 const int NUM_CHANNELS = 4;
@@ -51,9 +124,8 @@ const int MIXED_CHORD_CHANNEL = 3 - 1; // MIDI channel 13
 const int BASS_NOTE_CHANNEL = 4 - 1; // MIDI channel 14
 const int REALTIME_CHANNEL = 5 - 1; // MIDI channel 15
 const int REALTIME_BASS_NOTE_CHANNEL = 6 - 1; // MIDI channel 16
-
-vector<string> noteProgressionByChannel[NUM_CHANNELS];
-vector<int> chordChanges; // a list of every beat (zero-based) where a chord changes occurs
+const int NUM_OUTPUT_CHANNELS = REALTIME_BASS_NOTE_CHANNEL + 1;
+const char* const OUTPUT_CHANNEL_NAMES[NUM_OUTPUT_CHANNELS] = { "odd", "even", "mixed", "bass", "realtime", "realtime-bass" };
 
 const int TICKS_PER_QUARTER_NOTE = 384;
 
@@ -72,6 +144,108 @@ const string DEFAULT_ALSA_OUTPUT_NAME_2 = "midiLEDs-input";
 
 std::vector<unsigned char>* lastMidiMessageReceived;
 
+// Realtime engine: the RtMidi callback only queues incoming messages, the engine thread applies them and sends the output
+struct MidiInputEvent
+{
+	double timestamp; // seconds since the first message, from RtMidi's delta times
+	int64_t receivedNanoseconds; // monotonic clock when the callback queued the message
+	unsigned char size;
+	unsigned char bytes[3];
+};
+
+const uint32_t MIDI_EVENT_QUEUE_SIZE = 1024; // must be a power of two
+const int ENGINE_WAIT_MILLISECONDS = 1; // longest the engine sleeps if a wake-up is missed
+
+// single producer (RtMidi callback), single consumer (engine thread)
+MidiInputEvent midiEventQueue[MIDI_EVENT_QUEUE_SIZE];
+alignas(64) atomic<uint32_t> midiEventQueueHead(0); // next slot the callback writes
+alignas(64) atomic<uint32_t> midiEventQueueTail(0); // next slot the engine reads
+alignas(64) atomic<uint64_t> midiEventsDropped(0); // messages that don't fit in an event (not 1 to 3 bytes)
+atomic<uint64_t> midiEventQueueOverflows(0); // events lost because the engine fell behind
+
+double midiEventTimestamp = 0; // only touched by the callback
+
+atomic<bool> engineRunning(false);
+thread engineThread;
+mutex engineWakeMutex;
+condition_variable engineWakeCondition;
+
+// Live playback thread (--play)
+atomic<bool> playbackRunning(false);
+thread playbackThread;
+mutex playbackWakeMutex;
+condition_variable playbackWakeCondition;
+
+// Scale priority journal: the engine queues each priority change, a background thread appends it to the journal file
+struct PriorityChange
+{
+	uint16_t chord;
+	uint16_t scale;
+};
+
+const uint32_t PRIORITY_QUEUE_SIZE = 256; // must be a power of two
+const int JOURNAL_FLUSH_MILLISECONDS = 100;
+const string PRIORITY_JOURNAL_EXTENSION = ".journal"; // appended to the chord-scale mapping filename
+
+// single producer (engine thread), single consumer (journal thread)
+PriorityChange priorityQueue[PRIORITY_QUEUE_SIZE];
+alignas(64) atomic<uint32_t> priorityQueueHead(0);
+alignas(64) atomic<uint32_t> priorityQueueTail(0);
+alignas(64) atomic<uint64_t> priorityQueueOverflows(0); // changes applied but lost to the journal
+
+string priorityJournalFilename;
+vector<PriorityChange> priorityJournalEntries; // every change in the journal file, owned by the journal thread once it runs
+
+atomic<bool> journalRunning(false);
+thread journalThread;
+mutex journalWakeMutex;
+condition_variable journalWakeCondition;
+
+// Realtime latency: time from a message reaching the callback to each stage of its handling on the engine thread
+enum LatencyStage { STATE_UPDATED, SCALE_CHOSEN, OUTPUT_SENT, NUM_LATENCY_STAGES };
+const char* const LATENCY_STAGE_NAMES[NUM_LATENCY_STAGES] = { "state update", "scale lookup", "last send" };
+
+// log-linear buckets: exact below 16 ns, then 8 buckets per power of two (within 12.5%)
+const int LATENCY_EXACT_BUCKETS = 16;
+const int LATENCY_BUCKETS_PER_OCTAVE = 8;
+const int NUM_LATENCY_BUCKETS = LATENCY_EXACT_BUCKETS + 60 * LATENCY_BUCKETS_PER_OCTAVE;
+
+// written by the engine thread only, relaxed atomics so a report can read them at any time
+struct LatencyHistogram
+{
+	atomic<uint64_t> counts[NUM_LATENCY_BUCKETS];
+	atomic<uint64_t> maxNanoseconds;
+};
+
+LatencyHistogram latencyHistograms[NUM_LATENCY_STAGES];
+LatencyHistogram playbackJitter; // how late live playback sent each event
+
+int64_t currentEventReceived; // receive time of the event the engine is handling
+int currentEventStages; // stages already recorded for that event
+
+volatile sig_atomic_t latencyReportRequested = 0; // set by SIGUSR1, printed by the engine thread
+
+// Output scheduler (--link-rate): paces realtime output to the MIDI link, newer frames replace changes still queued
+const int DIN_MIDI_BAUD_RATE = 31250;
+const int BITS_PER_MIDI_BYTE = 10; // start bit, 8 data bits, stop bit
+
+bool scheduleOutput;
+int linkBaudRate;
+
+NoteSet scheduledFrames[NUM_OUTPUT_CHANNELS]; // what each channel shows once the queued changes are sent
+int64_t linkIdleNanoseconds = 0; // when the link is done with the bytes already sent
+bool scheduledUpdatePending = false; // an update message is owed for the changes sent so far
+int lastScheduledBrightness; // priority of the last change sent
+
+// written by the engine thread only
+atomic<int> scheduledQueueDepth(0); // changes waiting for the link
+atomic<int> maxScheduledQueueDepth(0);
+atomic<uint64_t> scheduledMessagesSent(0);
+atomic<uint64_t> scheduledChangesSuperseded(0); // queued changes replaced by a newer frame before being sent
+atomic<uint64_t> scheduledChangesDropped(0); // queued changes a newer frame made unnecessary
+
+void (*outputSink)(const unsigned char* message, size_t size) = NULL; // receives the output instead of midiOut, for a simulated link
+
 // Midi Messages
 const unsigned char noteOnCodeMin = (unsigned char)0x90;
 const unsigned char noteOnCodeMax = (unsigned char)0x9F;
@@ -93,44 +267,158 @@ bool* realtimeActive;
 const int numNotes = 128;
 const int numChannels = 16;
 
-vector<int> activeNotes[numChannels];
-vector<int> sostenutoNotes[numChannels];
-vector<int> damperNotes[numChannels];
+// Why each note of a channel is sounding: held keys are counted, pedal holds are flags
+const uint8_t DAMPER_HOLD = 1;
+const uint8_t SOSTENUTO_HOLD = 2;
+
+struct ChannelNoteState
+{
+	uint8_t keyHolds[numNotes];
+	uint8_t pedalHolds[numNotes];
+	uint8_t pitchClassCounts[NOTES_PER_OCTAVE]; // sounding notes of each pitch class
+	uint16_t pitchClassMask; // pitch classes with at least one sounding note
+};
 
-string activeChordScale;
-string activeSuggestedScale;
+ChannelNoteState channelNotes[numChannels];
 
-// File I/O
-MidiFile midiOutputFile;
+NoteSet activeChordScale;
+NoteSet activeSuggestedScale;
 
+// What the LEDs of each output channel currently show, so realtime output only sends what changed
+NoteSet emittedFrames[NUM_OUTPUT_CHANNELS];
+
+// File I/O
 enum IOtype { Input, Output };
 enum InputFileType { MMA, TXT };
 
 string chordScaleMappingFilename;
 string inputFilename;
 string outputFilename;
+const string STANDARD_OUTPUT_FILENAME = "-"; // -o - streams the rendered file to stdout
+streambuf* standardOutputBuffer; // stdout once everything else printed is moved to stderr
+string batchFilename;
+string renderCacheDirectory; // rendering is cached only when set
+string benchmarkFilename; // benchmark results go to stdout when not set
+string generatedFilename; // a synthetic progression is written instead of rendering when set
 
 InputFileType inputFileType;
 
+// A chord or scale symbol of a progression, parsed once when the song is loaded
+struct ChordSymbol
+{
+	uint8_t root; // note name as spelled, see parseNoteName()
+	uint8_t bass; // the root unless a slash bass is given
+	uint16_t type; // index into Song::chordTypes
+	uint32_t text; // offset of the symbol as written in Song::symbolText
+};
+
+// A stretch of the song holding one chord and its scale
+struct ProgressionSegment
+{
+	ChordSymbol chord;
+	ChordSymbol scale;
+	int64_t startTick;
+	int64_t duration; // in ticks, may be shorter than a beat
+};
+
+// Everything read and generated for one input file, so that several songs can be rendered at once
+// The progression is stored per segment rather than per beat, so a song costs as much as its chord changes
+struct Song
+{
+	string inputFilename;
+	string outputFilename;
+	InputFileType inputFileType;
+
+	int beatsPerMinute;
+	int64_t numBeats;
+	int64_t numTicks; // the end of the last segment
+
+	vector<ProgressionSegment> progression;
+	vector<NoteSet> noteProgression; // notes of each segment
+
+	vector<string> chordTypes; // every distinct chord type named by the progressions
+	string symbolText; // null-terminated text of every symbol
+
+	vector<NoteSet> noteProgressionByChannel[NUM_CHANNELS]; // notes of each segment on each channel
+	vector<int> chordChanges; // a list of every segment (zero-based) where a chord change occurs
+
+	MidiFile midiOutputFile;
+	int numRedundantEvents; // events left out of the output file because they changed nothing
+	uint64_t outputFileSize;
+	uint64_t numRunningStatusBytes; // status bytes left out of the output file by running status
+
+	int errorStatus;
+	bool unrecognizedChordTypes;
+
+	Song() : inputFileType(TXT), beatsPerMinute(0), numBeats(0), numTicks(0), numRedundantEvents(0), outputFileSize(0), numRunningStatusBytes(0), errorStatus(0), unrecognizedChordTypes(false) {}
+};
+
 const string BINASC_DIRECTORY = "binasc/";
 
 // Config data
 const string DEFAULT_CHORD_SCALE_MAPPING_FILENAME = "config/map/chord-scale.cfg";
+const string DEFAULT_CONFIG_BUNDLE_FILENAME = "config/config.bundle";
+const string DEFAULT_RENDER_CACHE_DIRECTORY = "cache";
+const string DEFAULT_CONFIG_HEADER_FILENAME = "config/embedded_config.h";
 
 const string CHORD_LIST_FILENAME = "config/chords.cfg";
 const string SCALE_LIST_FILENAME = "config/scales.cfg";
 
-map<string, deque<string>> chordScaleMap; // M7 : [ 'ionian , 'lydian , 'mixolydian , ... ]
+// Chord-scale mapping, eg. M7 : [ 'ionian , 'lydian , 'mixolydian , ... ]
+// Every possible chord mask has a slot pointing at its run of scale masks, which all live in one contiguous array
+struct ChordScaleSlot
+{
+	uint32_t offset; // index of the chord's first scale in chordScaleMasks
+	uint32_t length; // number of scales mapped to the chord (0 = unmapped)
+};
+
+const int NUM_NOTE_MASKS = 1 << NOTES_PER_OCTAVE;
+
+// The table is either built from the config files into the storage vectors or points straight into a mapped config bundle
+vector<ChordScaleSlot> chordScaleTableStorage;
+vector<uint16_t> chordScaleMaskStorage;
+
+const ChordScaleSlot* chordScaleTable; // NUM_NOTE_MASKS slots
+uint16_t* chordScaleMasks;
+uint32_t numChordScaleMasks;
+
+// Best ranked scale of every chord mask, so a suggestion is a single lookup (0 = unmapped)
+uint16_t chordTopScales[NUM_NOTE_MASKS];
 
-map<string, string> chordMap;
-map<string, string> scaleMap;
+map<string, NoteSet> chordMap;
+map<string, NoteSet> scaleMap;
 
-map<string, string> reverseChordMap;
-map<string, string> reverseScaleMap;
+map<NoteSet, string> reverseChordMap;
+map<NoteSet, string> reverseScaleMap;
 
 const int dimNoteVelocity = 8;
 const int brightNoteVelocity = 80;
 
+const int NUM_BRIGHTNESS_LEVELS = 3;
+const int NOTE_MESSAGE_SIZE = 3;
+const int MAX_NOTE_MESSAGES = 11; // a pitch class has at most 11 of the 128 MIDI pitches
+
+// Pitches shown by the instrument on a channel, C3 to C8 unless configured otherwise (--octaves)
+struct PitchRange
+{
+	int lowest;
+	int highest;
+};
+
+const PitchRange DEFAULT_PITCH_RANGE = { NOTES_PER_OCTAVE * STARTING_OCTAVE, NOTES_PER_OCTAVE * ENDING_OCTAVE };
+
+PitchRange channelPitchRanges[NUM_OUTPUT_CHANNELS] = { DEFAULT_PITCH_RANGE, DEFAULT_PITCH_RANGE, DEFAULT_PITCH_RANGE, DEFAULT_PITCH_RANGE, DEFAULT_PITCH_RANGE, DEFAULT_PITCH_RANGE };
+
+// The note messages of a pitch class on every octave in range, back to back
+struct NoteMessageRun
+{
+	unsigned char bytes[MAX_NOTE_MESSAGES * NOTE_MESSAGE_SIZE];
+	int numMessages;
+};
+
+// Built once so realtime output and file rendering never construct note messages
+NoteMessageRun noteMessageTable[NUM_OUTPUT_CHANNELS][NOTES_PER_OCTAVE][NUM_BRIGHTNESS_LEVELS];
+
 // Command line args
 vector<string> commandLineArgs;
 
@@ -139,10 +427,36 @@ bool brightMode;
 bool indicateBass;
 bool debugMode;
 bool ignoreScales;
+bool allChordSizes;
+bool varyScales; // suggest any mapped scale, picked by seed instead of by rank
+bool runningStatus; // write output files with running status, for controllers on slow links
+bool compactFrames; // show each channel's LEDs with one frame message instead of a note message per octave
+bool playMode; // play the rendered song on the MIDI out port instead of writing a file
+uint32_t scaleVariationSeed;
 
 bool realtimeMode;
+bool compileConfigMode;
+bool embedConfigMode;
+bool benchmarkMode;
 
 const string REALTIME_OPTION = "-t";
+const string COMPILE_CONFIG_OPTION = "--compile-config";
+const string EMBED_CONFIG_OPTION = "--embed-config";
+const string BATCH_OPTION = "--batch";
+const string RENDER_CACHE_OPTION = "--cache";
+const string VARY_SCALES_OPTION = "--vary";
+const string BENCHMARK_OPTION = "--bench"; // only in benchmark builds (see 'make bench')
+const string GENERATE_OPTION = "--generate";
+const string GENERATED_BEATS_OPTION = "--beats";
+const string CHORD_CHANGE_DENSITY_OPTION = "--change-density";
+const string SLASH_CHORD_RATIO_OPTION = "--slash-ratio";
+const string SCALE_RATIO_OPTION = "--scale-ratio";
+const string SEED_OPTION = "--seed";
+const string RUNNING_STATUS_OPTION = "--running-status";
+const string COMPACT_FRAMES_OPTION = "--frames";
+const string LINK_RATE_OPTION = "--link-rate";
+const string PLAY_OPTION = "--play";
+const string OCTAVES_OPTION = "--octaves"; // <channel>=<lowest>-<highest>, repeatable
 
 const string INPUT_FILE_OPTION = "-i";
 const string OUTPUT_FILE_OPTION = "-o";
@@ -151,39 +465,97 @@ const string BRIGHT_MODE_OPTION = "-b";
 const string INDICATE_BASS_OPTION = "-r";
 const string DEBUG_OPTION = "-d";
 const string CHORDS_ONLY_OPTION = "-c";
-
-const string EMPTY_NOTE_STRING = "000000000000";
-
+const string ALL_CHORD_SIZES_OPTION = "-a";
+
+// Synthetic progressions (--generate)
+const int64_t DEFAULT_GENERATED_BEATS = 1024;
+const int64_t MAX_GENERATED_BEATS = 1000000000; // well past the 10^7 beats measured, a generated file is about 5 bytes per beat
+const double DEFAULT_CHORD_CHANGE_DENSITY = 0.25; // chance of a new chord on any beat
+const double DEFAULT_SLASH_CHORD_RATIO = 0.1; // chance of a new chord having a bass note
+const double DEFAULT_SCALE_RATIO = 0.5; // chance of a new chord naming its scale
+const int GENERATED_BPM = 120;
+const int BEATS_PER_BAR = 4;
+const int BARS_PER_LINE = 4;
+
+int64_t generatedBeats;
+double chordChangeDensity;
+double slashChordRatio;
+double scaleRatio;
+uint32_t generatorSeed;
+
+// chord sizes covered by a generated chord-scale mapping (-a covers every size)
 const int MIN_CHORD_SIZE = 3;
 const int MAX_CHORD_SIZE = 7;
 
 
+void stopRealtimeEngine()
+{
+	if (!engineThread.joinable()) return;
+
+	engineRunning = false;
+	engineWakeCondition.notify_one();
+	engineThread.join();
+}
+
+void stopPriorityJournal()
+{
+	if (!journalThread.joinable()) return;
+
+	journalRunning = false;
+	journalWakeCondition.notify_one();
+	journalThread.join();
+}
+
+// Stops a looping song, or waits for a song that does not loop to end
+void stopPlayback(bool waitForEnd)
+{
+	if (!waitForEnd)
+	{
+		playbackRunning = false;
+		playbackWakeCondition.notify_all();
+	}
+
+	if (playbackThread.joinable()) playbackThread.join();
+}
+
 void end(int status)
 {
-	delete midiIn;
+	delete midiIn; // no more callbacks
+	midiIn = NULL;
+	stopRealtimeEngine(); // sends whatever is still queued
+	stopPlayback(false);
+	stopPriorityJournal(); // writes the last changes and compacts the journal
 	delete midiOut;
 	exit(status);
 }
 
-string copyString(string str)
+NoteSet shiftNotesRight(NoteSet notes, int offset)
 {
-	string copiedString = "";
-	
-	for (int i = 0; i < str.size(); i++)
-	{
-		copiedString += str[i];
-	}
-	
-	return copiedString;
+	offset %= NOTES_PER_OCTAVE;
+	if (offset < 0) offset += NOTES_PER_OCTAVE;
+
+	uint16_t low = ((notes.lowBits << offset) | (notes.lowBits >> (NOTES_PER_OCTAVE - offset))) & ALL_NOTES_MASK;
+	uint16_t high = ((notes.highBits << offset) | (notes.highBits >> (NOTES_PER_OCTAVE - offset))) & ALL_NOTES_MASK;
+	return NoteSet(low, high);
 }
 
-string shiftStringRight(string str, int offset)
+// Keeps only the notes present in the mask, at their original brightness
+NoteSet filterNotes(NoteSet notes, uint16_t mask)
 {
-	string rotatedStr = copyString(str);
-	
-	rotate(rotatedStr.rbegin(), rotatedStr.rbegin()+offset, rotatedStr.rend());
-	//cout << "Original string: '" << str << "' Rotated string: '" << rotatedStr << "' with offset of " << offset << endl;
-	return rotatedStr;
+	return NoteSet(notes.lowBits & mask, notes.highBits & mask);
+}
+
+// Mirrors the mask so that C becomes the most significant note; sorting by the result sorts masks like their note strings
+uint16_t reverseNoteMask(uint16_t mask)
+{
+	uint16_t reversedMask = 0;
+
+	for (int i = 0; i < NOTES_PER_OCTAVE; i++)
+	{
+		if (mask & (1 << i)) reversedMask |= 1 << (NOTES_PER_OCTAVE - 1 - i);
+	}
+
+	return reversedMask;
 }
 
 string boolToText(bool b)
@@ -213,14 +585,32 @@ uint32_t getMicrosecondsPerBeat(int beatsPerMinute)
 	return microsecondsPerBeat;
 }
 
-bool isValidNoteString(string str)
+// Converts a note string such as "201021020102" to a NoteSet; returns false if the string is not a valid note string
+bool parseNoteString(const string& str, NoteSet& notes)
 {
-	int numZeroes = count(str.begin(), str.end(), '0');
-	int numOnes = count(str.begin(), str.end(), '1');
-	int numTwos = count(str.begin(), str.end(), '2');
-	
-	if (str.size() == NOTES_PER_OCTAVE && ((numZeroes + numOnes + numTwos) == NOTES_PER_OCTAVE)) return true;
-	else return false;
+	if (str.size() != NOTES_PER_OCTAVE) return false;
+
+	NoteSet parsedNotes;
+	for (int i = 0; i < NOTES_PER_OCTAVE; i++)
+	{
+		if (str[i] < '0' || str[i] > '2') return false;
+		parsedNotes.setBrightness(i, str[i] - '0');
+	}
+
+	notes = parsedNotes;
+	return true;
+}
+
+string getNoteString(NoteSet notes)
+{
+	string noteString(NOTES_PER_OCTAVE, '0');
+
+	for (int i = 0; i < NOTES_PER_OCTAVE; i++)
+	{
+		noteString[i] += notes.brightness(i);
+	}
+
+	return noteString;
 }
 
 string getRoot(string chordName)
@@ -363,24 +753,99 @@ vector<string> split(string str, char delim)
 	return words;
 }
 
+// Lower is better: scales with fewer avoid notes (a half step above a chord tone), then smaller scales
+int getScaleScore(uint16_t chord, uint16_t scale)
+{
+	uint16_t halfStepAboveChord = ((chord << 1) | (chord >> (NOTES_PER_OCTAVE - 1))) & ALL_NOTES_MASK;
+	int numAvoidNotes = __builtin_popcount(scale & halfStepAboveChord & ~chord);
+
+	return numAvoidNotes * (NOTES_PER_OCTAVE + 1) + __builtin_popcount(scale);
+}
+
+// Picks the top scale of every chord, ties go to the scale listed first
+void rankChordScales()
+{
+	for (int chord = 0; chord < NUM_NOTE_MASKS; chord++)
+	{
+		const ChordScaleSlot& slot = chordScaleTable[chord];
+
+		chordTopScales[chord] = 0;
+		int bestScore = 0;
+
+		for (uint32_t i = 0; i < slot.length; i++)
+		{
+			uint16_t scale = chordScaleMasks[slot.offset + i];
+			int score = getScaleScore(chord, scale);
+
+			if (i == 0 || score < bestScore)
+			{
+				chordTopScales[chord] = scale;
+				bestScore = score;
+			}
+		}
+	}
+}
+
+// Moves the scale to the front of the chord's scales in place and makes it the top pick
+// Returns false if the scale is not mapped to the chord
+bool prioritizeScale(uint16_t chord, uint16_t scale)
+{
+	const ChordScaleSlot& slot = chordScaleTable[chord];
+
+	uint16_t* first = chordScaleMasks + slot.offset;
+	uint16_t* last = first + slot.length;
+	uint16_t* existing = find(first, last, scale);
+
+	if (existing == last) return false;
+
+	rotate(first, existing, existing + 1);
+	chordTopScales[chord] = scale;
+	return true;
+}
+
+// Replaces the chord-scale table with the given scales for every chord mask
+void buildChordScaleTable(const vector<vector<uint16_t>>& scalesByChord)
+{
+	chordScaleTableStorage.assign(NUM_NOTE_MASKS, ChordScaleSlot());
+	chordScaleMaskStorage.clear();
+
+	for (int chord = 0; chord < NUM_NOTE_MASKS; chord++)
+	{
+		const vector<uint16_t>& scales = scalesByChord[chord];
+
+		chordScaleTableStorage[chord].offset = chordScaleMaskStorage.size();
+		chordScaleTableStorage[chord].length = scales.size();
+		chordScaleMaskStorage.insert(chordScaleMaskStorage.end(), scales.begin(), scales.end());
+	}
+
+	chordScaleTable = chordScaleTableStorage.data();
+	chordScaleMasks = chordScaleMaskStorage.data();
+	numChordScaleMasks = chordScaleMaskStorage.size();
+
+	rankChordScales();
+}
+
 string getChordScaleMappingString()
 {
 	string chordScaleMappingString = "";
 
-	map<string,deque<string>>::iterator it;
-	for (it = chordScaleMap.begin(); it != chordScaleMap.end(); it++)
+	// list chords in note string order
+	for (int sortKey = 0; sortKey < NUM_NOTE_MASKS; sortKey++)
 	{
-		string chord = it->first;
-		//string chordName = reverseChordMap[chord];
-		//if (chordName.size() > 0) chord = chordName;
+		uint16_t chordMask = reverseNoteMask(sortKey);
+		const ChordScaleSlot& slot = chordScaleTable[chordMask];
 
-		deque<string> scales = it->second;
+		if (slot.length == 0) continue;
+
+		string chord = getNoteString(NoteSet(chordMask, 0));
+		//string chordName = reverseChordMap[NoteSet(chordMask, 0)];
+		//if (chordName.size() > 0) chord = chordName;
 
 		string scalesString = "[ ";
-		for (int i = 0; i < scales.size(); i++)
+		for (int i = 0; i < slot.length; i++)
 		{
-			string scale = scales[i];
-			//string scaleName = reverseScaleMap[scale];
+			string scale = getNoteString(NoteSet(chordScaleMasks[slot.offset + i], 0));
+			//string scaleName = reverseScaleMap[NoteSet(chordScaleMasks[slot.offset + i], 0)];
 			//if (scaleName.size() > 0) scale = scaleName;
 
 			scalesString += scale;
@@ -404,131 +869,133 @@ void writeChordScaleMapping(string filename)
 	chordScaleMappingFile.close();
 }
 
-// Only C-root chords
-vector<string> generateAllChordsOfSize(int n)
+// Every scale in all 12 transpositions: row r holds each scale transposed up r semitones, in note string order of the untransposed scales
+vector<uint16_t> getTransposedScaleRows()
 {
-	vector<string> allPossibleChords;
+	vector<uint16_t> scaleRows(NOTES_PER_OCTAVE * reverseScaleMap.size());
 
-	const int stringLength = NOTES_PER_OCTAVE - 1;
-	int numStrings = (int) pow(2, stringLength);
-
-	for (int i = 0; i < numStrings; i++)
+	int scaleIndex = 0;
+	for (map<NoteSet,string>::const_iterator it = reverseScaleMap.begin(); it != reverseScaleMap.end(); it++, scaleIndex++)
 	{
-		string binaryString = bitset<stringLength>(i).to_string();
-		
-		int numOnes = 0;
-		for (int j = 0; j < binaryString.size(); j++)
+		for (int offset = 0; offset < NOTES_PER_OCTAVE; offset++)
 		{
-			if (binaryString[j] == '1') numOnes++;
-		}
-
-		if (numOnes == n-1)
-		{
-			string chord = "1" + binaryString;
-			allPossibleChords.push_back(chord);
+			scaleRows[offset * reverseScaleMap.size() + scaleIndex] = shiftNotesRight(it->first, offset).mask();
 		}
 	}
 
-	return allPossibleChords;
+	return scaleRows;
 }
 
-// Only C-root chords
-vector<string> generateAllPossibleChords()
+// Counts the scales that contain every note of the chord
+int countMatchingScales(uint16_t chord, const uint16_t* scales, int numScales)
 {
-	vector<string> allPossibleChords;
+	int numMatches = 0;
+	int i = 0;
+
+#ifdef __SSE2__
+	__m128i chordNotes = _mm_set1_epi16(chord);
+	__m128i noMissingNotes = _mm_setzero_si128();
 
-	for (int n = MIN_CHORD_SIZE; n <= MAX_CHORD_SIZE; n++)
+	for (; i + 8 <= numScales; i += 8)
 	{
-		vector<string> all_n_note_chords = generateAllChordsOfSize(n);
-		for (int i = 0; i < all_n_note_chords.size(); i++)
-		{
-			allPossibleChords.push_back(all_n_note_chords[i]);
-		}
+		__m128i scaleNotes = _mm_loadu_si128((const __m128i*)(scales + i));
+		__m128i missingNotes = _mm_andnot_si128(scaleNotes, chordNotes); // chord & ~scale
+		int matchBytes = _mm_movemask_epi8(_mm_cmpeq_epi16(missingNotes, noMissingNotes));
+		numMatches += __builtin_popcount(matchBytes) / 2;
+	}
+#endif
+
+	for (; i < numScales; i++)
+	{
+		if ((chord & ~scales[i]) == 0) numMatches++;
 	}
 
-	return allPossibleChords;
+	return numMatches;
 }
 
-deque<string> findMatchingScales(string chord)
+// Maps one chord to the scales of whichever of its notes, taken as the root, matches the most scales
+// Ties go to the root whose C-rooted chord comes first in note string order, then to the lowest root
+void generateChordScales(uint16_t chord, const vector<uint16_t>& scaleRows, vector<uint16_t>& scales)
 {
-	deque<string> matchingScales;
+	int numScales = scaleRows.size() / NOTES_PER_OCTAVE;
+
+	int bestRoot = -1;
+	int bestNumMatches = 0;
+	uint16_t bestSortKey = 0;
 
-	map<string,string>::iterator it;
-	for (it = reverseScaleMap.begin(); it != reverseScaleMap.end(); it++)
+	for (int root = 0; root < NOTES_PER_OCTAVE; root++)
 	{
-		bool matches = true;
+		if (!(chord & (1 << root))) continue;
 
-		string scale = it->first;
-		for (int i = 0; i < scale.size(); i++)
-		{
-			if (chord[i] == '1' && scale[i] == '0')
-			{
-				matches = false;
-				break;
-			}
-		}
+		const uint16_t* row = &scaleRows[root * numScales];
+		int numMatches = countMatchingScales(chord, row, numScales);
+		uint16_t sortKey = reverseNoteMask(shiftNotesRight(NoteSet(chord, 0), -root).mask());
 
-		if (matches)
+		if (numMatches > bestNumMatches || (numMatches == bestNumMatches && numMatches > 0 && sortKey < bestSortKey))
 		{
-			matchingScales.push_back(scale);
+			bestRoot = root;
+			bestNumMatches = numMatches;
+			bestSortKey = sortKey;
 		}
 	}
 
-	return matchingScales;
+	scales.clear();
+	if (bestRoot < 0) return;
+
+	const uint16_t* row = &scaleRows[bestRoot * numScales];
+	for (int i = 0; i < numScales; i++)
+	{
+		if ((chord & ~row[i]) == 0) scales.push_back(row[i]);
+	}
 }
 
 void generateChordScaleMapping(string filename)
 {
-	vector<string> allPossibleChords = generateAllPossibleChords();
-	map<string,deque<string>> cMap;
+	vector<uint16_t> scaleRows = getTransposedScaleRows();
+	vector<vector<uint16_t>> scalesByChord(NUM_NOTE_MASKS);
 
-	for (int i = 0; i < allPossibleChords.size(); i++)
-	{
-		string chord = allPossibleChords[i];
-		deque<string> matchingScales = findMatchingScales(chord);
-		cMap.insert(pair<string,deque<string>>(chord, matchingScales));
-	}
+	int minChordSize = allChordSizes ? 1 : MIN_CHORD_SIZE;
+	int maxChordSize = allChordSizes ? NOTES_PER_OCTAVE : MAX_CHORD_SIZE;
 
-	// Make a copy of each mapping for every key
-	map<string,deque<string>>::iterator it;
-	for (it = cMap.begin(); it != cMap.end(); it++)
+	// Every chord writes only its own slot, so workers just take the next batch of chords until none are left
+	const int CHORDS_PER_BATCH = 64;
+	atomic<int> nextChord(0);
+
+	vector<thread> workers;
+	int numWorkers = max(1, (int)thread::hardware_concurrency());
+
+	for (int w = 0; w < numWorkers; w++)
 	{
-		for (int i = 0; i < 12; i++)
+		workers.push_back(thread([&]()
 		{
-			string chord = it->first;
-			deque<string> scales = it->second;
-			
-			string rotatedChord = shiftStringRight(chord, i);
-			deque<string> rotatedScales;
-			for (int j = 0; j < scales.size(); j++)
-			{
-				rotatedScales.push_back(shiftStringRight(scales[j], i));
-			}
-
-			// If chord is already mapped, delete it if we just generated a better mapping
-			map<string,deque<string>>::iterator itz = chordScaleMap.find(rotatedChord);
-			if (itz != chordScaleMap.end())
+			for (int firstChord = nextChord.fetch_add(CHORDS_PER_BATCH); firstChord < NUM_NOTE_MASKS; firstChord = nextChord.fetch_add(CHORDS_PER_BATCH))
 			{
-				deque<string> existingScales = itz->second;
-				if (rotatedScales.size() > existingScales.size())
+				for (int chord = firstChord; chord < firstChord + CHORDS_PER_BATCH && chord < NUM_NOTE_MASKS; chord++)
 				{
-					chordScaleMap.erase(itz);
+					int chordSize = __builtin_popcount(chord);
+					if (chordSize < minChordSize || chordSize > maxChordSize) continue;
+
+					generateChordScales(chord, scaleRows, scalesByChord[chord]);
 				}
 			}
+		}));
+	}
 
-			if (rotatedScales.size() > 0)
-			{
-				chordScaleMap.insert(pair<string, deque<string>>(rotatedChord, rotatedScales));
-			}
-		}
+	for (int w = 0; w < numWorkers; w++)
+	{
+		workers[w].join();
 	}
 
+	buildChordScaleTable(scalesByChord);
+
 	writeChordScaleMapping(filename);
 }
 
 void loadChordScaleMapping(string filename)
 {
-	// Read file to chordScaleMap
+	// Read file to chordScaleTable
+
+	vector<vector<uint16_t>> scalesByChord(NUM_NOTE_MASKS);
 
 	vector<string> lines = getLines(filename);
 	
@@ -536,1651 +1003,4995 @@ void loadChordScaleMapping(string filename)
 	{
 		string line = lines[i];
 		
-		string chord;
-		deque<string> scales;
+		NoteSet chord;
+		vector<uint16_t> scales;
 
 		vector<string> words = split(line, ' ');
 
-		chord = words[0];
-		if (!isValidNoteString(chord)) chord = chordMap[words[0]];
-		if (!isValidNoteString(chord))
+		if (!parseNoteString(words[0], chord))
 		{
-			cerr << "ERROR (" << filename << "): '" << words[0] << "' is not a valid chord. Exiting..." << endl;
-			errorStatus = 2;
-			exit(errorStatus);
+			map<string, NoteSet>::iterator namedChord = chordMap.find(words[0]);
+			if (namedChord == chordMap.end())
+			{
+				cerr << "ERROR (" << filename << "): '" << words[0] << "' is not a valid chord. Exiting..." << endl;
+				errorStatus = 2;
+				exit(errorStatus);
+			}
+			chord = namedChord->second;
 		}
 
 		for (int i = 1; i < words.size(); i++)
 		{
 			string word = words[i];
-			string scale = "";
+			NoteSet scale;
 
 			if (word.compare(":") == 0) continue;
 			else if (word.compare("[") == 0) continue;
 			else if (word.compare("]") == 0) continue;
 			else if (word.compare(",") == 0) continue;
 
-			else scale = word;
-			if (!isValidNoteString(scale)) scale = scaleMap[word];
-			if (!isValidNoteString(scale))
+			if (!parseNoteString(word, scale))
 			{
-				cerr << "ERROR (" << filename << "): '" << word << "' is not a valid scale. Exiting..." << endl;
-				errorStatus = 2;
-				exit(errorStatus);
+				map<string, NoteSet>::iterator namedScale = scaleMap.find(word);
+				if (namedScale == scaleMap.end())
+				{
+					cerr << "ERROR (" << filename << "): '" << word << "' is not a valid scale. Exiting..." << endl;
+					errorStatus = 2;
+					exit(errorStatus);
+				}
+				scale = namedScale->second;
 			}
 
-			scales.push_back(scale);
+			scales.push_back(scale.mask());
 		}
 
-		chordScaleMap.insert(pair<string, deque<string>>(chord, scales));
+		// first mapping listed for a chord wins
+		if (scalesByChord[chord.mask()].empty())
+		{
+			scalesByChord[chord.mask()] = scales;
+		}
 	}
+
+	buildChordScaleTable(scalesByChord);
 }
 
-void loadCPSfile(string filename)
+void loadOrGenerateChordScaleMapping(string filename)
 {
-	// Stuff all chord names in the chord progression vector
-	// For each chord:
-	//	Get the associated scale (append root of chord at beginning if not specified)
-	//	else add "empty" to scaleProgression vector
+	ifstream f(filename.c_str());
+	bool fileExists = f.good();
+	f.close();
 
-	vector<string> lines = getLines(filename);
-	
-	bool foundChordsSection = false;
-	
-	for (int i = 0; i < lines.size(); i++)
+	if (fileExists)
 	{
-		string line = lines[i];
-		
-		if (foundChordsSection)
-		{
-			vector<string> words = split(line, ' ');
-			
-			for (int i = 0; i < words.size(); i++)
-			{
-				string word = words[i];
-				
-				string chord = "";
-				string scale = "empty";
-				
-				if (word.compare("|") == 0)
-				{
-					// skip
-					continue;
-				}
-				else if (word.compare(".") == 0 || word.compare("/") == 0)
-				{
-					// repeat
-					chord = chordProgression.back();
-					scale = scaleProgression.back();
-				}
-				else if (word.find("_") != string::npos)
-				{
-					// everything before '_' is chord, everything after '_' is scale
-					int indexOfUnderscore = word.find("_");
-					
-					chord = word.substr(0, indexOfUnderscore);
-					scale = word.substr(indexOfUnderscore+1);
-					
-					if (getRoot(chord).size() == 0)
-					{
-						chord = "C" + chord; // default to root of C if none specified
-					}
-					
-					if (getRoot(scale).size() == 0)
-					{
-						//cout << "Appending root note '" << getRoot(chord) << "' from chord '" << chord << "' to scale '" << scale << "'" << endl;
-						scale = getRoot(chord) + scale; // append root of chord to scale name
-					}
-					
-					// need to append bass note to scale if specified for chord but not for scale
-					if (scale.find("/") == string::npos && chord.find("/") != string::npos)
-					{
-						scale += "/" + getBass(chord);
-					}
-				}
-				else
-				{
-					chord = word;
-					if (getRoot(chord).size() == 0)
-					{
-						chord = "C" + chord; // default to root of C if none specified
-					}
-				}
-				
-				chordProgression.push_back(chord);
-				scaleProgression.push_back(scale);
-			}
-			
-		}
-		
-		else if (endsWith(line, "BPM"))
-		{
-			stringstream ss(line);
-			string temp;
-			ss >> temp >> beatsPerMinute;
-		}
-		
-		else if (line.compare("Chords:") == 0)
-		{
-			foundChordsSection = true;
-		}
+		loadChordScaleMapping(filename);
 	}
-		
-	if (beatsPerMinute == 0)
+	
+	else
 	{
-		cerr << "ERROR: No tempo found in input file: " << inputFilename << endl;
-		cerr << "Exiting..." << endl;
-		errorStatus = 2;
-		end(errorStatus);
+		generateChordScaleMapping(filename);
 	}
 }
 
-void loadMMAfile(string filename)
+// Reapplies the priority changes journaled for the mapping, keeping the ones that still apply to it
+void replayPriorityJournal()
 {
-	cerr << "ERROR: MMA files not yet supported." << endl;
-	cerr << "Exiting..." << endl;
-	errorStatus = 1;
-	end(errorStatus);
-}
+	priorityJournalEntries.clear();
 
-void loadInput(string filename)
-{	
-	switch (inputFileType)
+	vector<string> lines = getLines(priorityJournalFilename);
+
+	for (int i = 0; i < lines.size(); i++)
 	{
-		case TXT:
-			loadCPSfile(filename);
-			break;
-		case MMA:
-			loadMMAfile(filename);
-			break;
-	}
+		vector<string> words = split(lines[i], ' ');
 
-}
+		NoteSet chord;
+		NoteSet scale;
 
-void setInputFileType(string filename)
-{
-	if (endsWith(filename, ".txt")) inputFileType = TXT;
-	else if (endsWith(filename, ".mma")) inputFileType = MMA;
-	else
-	{
-		stringstream ss;
-		ss << "ERROR: Unrecognized input file type for input file: " << filename;
-		cerr << ss.str() << endl;
-		errorStatus = 1;
-		end(errorStatus);
-	}
-}
+		if (words.size() != 2 || !parseNoteString(words[0], chord) || !parseNoteString(words[1], scale))
+		{
+			if (debugMode) cerr << "WARNING - replayPriorityJournal(): invalid line " << i+1 << " in '" << priorityJournalFilename << "'. Ignoring..." << endl;
+			continue;
+		}
 
-bool setIOFile(int argNumber, IOtype ioType)
-{
-	string arg = getArg(argNumber);
-	
-	switch (ioType)
-	{
-		case Input:
-			setInputFileType(arg);
-			inputFilename = arg;
-			break;
-		case Output:
-			outputFilename = arg;
-			break;
+		PriorityChange change;
+		change.chord = chord.mask();
+		change.scale = scale.mask();
+
+		if (prioritizeScale(change.chord, change.scale)) priorityJournalEntries.push_back(change);
 	}
 }
 
-void setChordScaleMappingFile(int argNumber)
+void writePriorityChange(ostream& journalFile, const PriorityChange& change)
 {
-	chordScaleMappingFilename = getArg(argNumber);
+	journalFile << getNoteString(NoteSet(change.chord, 0)) << " " << getNoteString(NoteSet(change.scale, 0)) << "\n";
 }
 
-void setInputFile(int argNumber)
+// Appends whatever the engine has queued, returns false once the queue was empty
+bool appendPriorityChanges(ofstream& journalFile)
 {
-	setIOFile(argNumber, Input);
-}
+	uint32_t tail = priorityQueueTail.load(memory_order_relaxed);
+	uint32_t head = priorityQueueHead.load(memory_order_acquire);
 
-void setOutputFile(int argNumber)
-{
-	setIOFile(argNumber, Output);
+	if (tail == head) return false;
+
+	for (; tail != head; tail++)
+	{
+		const PriorityChange& change = priorityQueue[tail & (PRIORITY_QUEUE_SIZE - 1)];
+		writePriorityChange(journalFile, change);
+		priorityJournalEntries.push_back(change);
+	}
+
+	priorityQueueTail.store(tail, memory_order_release);
+	journalFile.flush();
+	return true;
 }
 
-bool processOption(int argNumber)
+// Rewrites the journal keeping only the last change of each chord and scale, which replays to the same priorities
+void compactPriorityJournal()
 {
-	string arg = getArg(argNumber);
+	vector<PriorityChange> compacted;
+	set<uint32_t> seen;
 
-	if (arg.compare(REALTIME_OPTION) == 0)
-	{
-		realtimeMode = true;
-		if (argNumber+1 < getArgCount())
-		{
-			setChordScaleMappingFile(argNumber+1);
-			return true;
-		}
-	}	
-	else if (arg.compare(INPUT_FILE_OPTION) == 0)
-	{
-		setInputFile(argNumber+1);
-		return true;
-	}	
-	else if (arg.compare(OUTPUT_FILE_OPTION) == 0)
-	{
-		setOutputFile(argNumber+1);
-		return true;
-	}
-	else if (arg.compare(LOOP_MODE_OPTION) == 0)
-	{
-		toggle(loopMode);
-	}	
-	else if (arg.compare(DEBUG_OPTION) == 0)
-	{
-		toggle(debugMode);
-	}
-	else if (arg.compare(BRIGHT_MODE_OPTION) == 0)
+	for (int i = priorityJournalEntries.size() - 1; i >= 0; i--)
 	{
-		toggle(brightMode);
+		const PriorityChange& change = priorityJournalEntries[i];
+		if (seen.insert((uint32_t)change.chord << 16 | change.scale).second) compacted.push_back(change);
 	}
-	else if (arg.compare(INDICATE_BASS_OPTION) == 0)
+
+	reverse(compacted.begin(), compacted.end());
+
+	if (compacted.empty())
 	{
-		toggle(indicateBass);
+		remove(priorityJournalFilename.c_str());
+		return;
 	}
-	else if (arg.compare(CHORDS_ONLY_OPTION) == 0)
+
+	string compactedFilename = priorityJournalFilename + ".tmp";
+	ofstream compactedFile(compactedFilename.c_str());
+
+	for (int i = 0; i < compacted.size(); i++)
 	{
-		toggle(ignoreScales);
+		writePriorityChange(compactedFile, compacted[i]);
 	}
-	else
+
+	compactedFile.close();
+
+	if (!compactedFile || rename(compactedFilename.c_str(), priorityJournalFilename.c_str()) != 0)
 	{
-		stringstream ss;
-		ss << "ERROR: Unrecoginized command line argument #" << argNumber << ": " << arg;
-		cerr << ss.str() << endl;
-		errorStatus = 1;
-		end(errorStatus);
+		cerr << "WARNING: Could not compact scale priority journal '" << priorityJournalFilename << "'." << endl;
+		remove(compactedFilename.c_str());
 	}
-	
-	return false;
-	
 }
 
-void loadChordMap(string filename, map<string, string>* forwardMap, map<string, string>* reverseMap)
+void runPriorityJournal()
 {
-	string mostRecentNoteString = "";
-	vector<string> lines = getLines(filename);
-	for (int i = 0; i < lines.size(); i++)
+	ofstream journalFile(priorityJournalFilename.c_str(), ios::app);
+
+	while (true)
 	{
-		string line = lines[i];
-		if (line.size() <= 0)
-			continue;
-			
-		string chordType = "";
-		string noteString = "";
-		
-		bool foundTab = false;
-		for (int j = 0; j < line.length(); j++) 
-		{
-			char c = line[j];
-			if (c == '\t') 
-			{
-				foundTab = true;
-			}
-			else if (foundTab)
-			{
-				noteString += c;
-			}
-			else
-			{
-				chordType += c;
-			}
-		}
-		
-		if (noteString.compare(".") == 0)
-			noteString = copyString(mostRecentNoteString);
-		else if (isValidNoteString(noteString))
-			mostRecentNoteString = copyString(noteString);
-		else
-		{
-			cerr << "ERROR: In file '" << filename << "'" << endl;
-			cerr << "Note String " << noteString << " is not valid." << endl;
-			cerr << "Exiting..." << endl;
-			errorStatus = 3;
-			end(errorStatus);
-		}
-		
-		forwardMap->insert(pair<string, string>(chordType, noteString));
-		reverseMap->insert(pair<string, string>(noteString, chordType));
+		if (appendPriorityChanges(journalFile)) continue;
+		if (!journalRunning) break; // stopped and drained
+
+		unique_lock<mutex> lock(journalWakeMutex);
+		journalWakeCondition.wait_for(lock, chrono::milliseconds(JOURNAL_FLUSH_MILLISECONDS));
 	}
-}
 
-void loadConfig() 
-{
-	loadChordMap(CHORD_LIST_FILENAME, &chordMap, &reverseChordMap);
-	loadChordMap(SCALE_LIST_FILENAME, &scaleMap, &reverseScaleMap);
+	journalFile.close();
+	compactPriorityJournal();
 }
 
-string normalizeBrightness(string chord)
+// Applies the journal of the loaded mapping and starts recording new priority changes to it
+void startPriorityJournal(const string& mappingFilename)
 {
-	string normalizedChord = "";
-	
-	bool foundOne = false;
-	bool foundTwo = false;
-	
-	for (int i = 0; i < chord.size(); i++)
-	{
-		if (chord[i] == '1') foundOne = true;
-		else if (chord[i] == '2') foundTwo = true;
-	}
-	
-	bool shouldNormalize = foundOne && !foundTwo;
-	
-	if (shouldNormalize)
-	{
-		for (int i = 0; i < chord.size(); i++)
-		{
-			if (chord[i] == '1') normalizedChord += '2';
-			else normalizedChord += '0';
-		}
-		
-		return normalizedChord;
-	}
-	
-	else
-	{
-		return chord;
-	}
-	
+	priorityJournalFilename = mappingFilename + PRIORITY_JOURNAL_EXTENSION;
+	replayPriorityJournal();
+
+	journalRunning = true;
+	journalThread = thread(runPriorityJournal);
 }
 
-string combineChords(string chord1, string chord2)
+// Queues a priority change for the journal thread, never blocks
+void journalPriorityChange(uint16_t chord, uint16_t scale)
 {
-	string combinedChord = "";
-	
-	for (int i = 0; i < chord1.length(); i++)
+	if (!journalRunning) return;
+
+	uint32_t head = priorityQueueHead.load(memory_order_relaxed);
+
+	if (head - priorityQueueTail.load(memory_order_acquire) >= PRIORITY_QUEUE_SIZE)
 	{
-		combinedChord += chord1[i] + chord2[i] - '0';
+		priorityQueueOverflows.fetch_add(1, memory_order_relaxed);
+		return;
 	}
-	
-	if (brightMode)
-		combinedChord = normalizeBrightness(combinedChord);
-	
-	return combinedChord;
+
+	PriorityChange& change = priorityQueue[head & (PRIORITY_QUEUE_SIZE - 1)];
+	change.chord = chord;
+	change.scale = scale;
+
+	priorityQueueHead.store(head + 1, memory_order_release);
 }
 
-int getNoteIndex(string note)
+bool mapInputFile(const string& filename, char*& data, size_t& size)
 {
-	if (note.compare("C") == 0)
-	{
-		return 0;
-	}	
-	else if (note.compare("C#") == 0 || note.compare("Db") == 0)
-	{
-		return 1;
-	}	
-	else if (note.compare("D") == 0)
-	{
-		return 2;
-	}	
-	else if (note.compare("D#") == 0 || note.compare("Eb") == 0)
-	{
-		return 3;
-	}
-	else if (note.compare("E") == 0)
-	{
-		return 4;
-	}
-	else if (note.compare("F") == 0)
-	{
-		return 5;
-	}
-	else if (note.compare("F#") == 0 || note.compare("Gb") == 0)
-	{
-		return 6;
-	}
-	else if (note.compare("G") == 0)
-	{
-		return 7;
-	}
-	else if (note.compare("G#") == 0 || note.compare("Ab") == 0)
-	{
-		return 8;
-	}
-	else if (note.compare("A") == 0)
-	{
-		return 9;
-	}
-	else if (note.compare("A#") == 0 || note.compare("Bb") == 0)
-	{
-		return 10;
-	}
-	else if (note.compare("B") == 0)
+	data = NULL;
+	size = 0;
+
+#ifdef __WINDOWS_MM__
+	ifstream inputFile(filename.c_str(), ios::binary | ios::ate);
+	if (!inputFile.good()) return false;
+
+	size = inputFile.tellg();
+	data = new char[size + 1];
+	inputFile.seekg(0);
+	inputFile.read(data, size);
+	return inputFile.good();
+#else
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0) return false;
+
+	struct stat fileInfo;
+	if (fstat(fd, &fileInfo) != 0)
 	{
-		return 11;
+		close(fd);
+		return false;
 	}
-	else
+
+	if (fileInfo.st_size > 0)
 	{
-		if (debugMode)
+		void* mapping = mmap(NULL, fileInfo.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (mapping != MAP_FAILED)
 		{
-			stringstream ss;
-			ss << "WARNING - getNoteIndex(): Unrecoginized note: '" << note << "'";
-			cout << ss.str() << endl;
+			data = (char*)mapping;
+			size = fileInfo.st_size;
 		}
-		return -1;
 	}
+	close(fd);
+
+	return data != NULL || fileInfo.st_size == 0;
+#endif
+}
+
+void unmapInputFile(char* data, size_t size)
+{
+	if (data == NULL) return;
+
+#ifdef __WINDOWS_MM__
+	delete[] data;
+#else
+	munmap(data, size);
+#endif
 }
 
-string getChordNoteString(string chordType)
+// A view of part of the input buffer, tokens are never copied out of the file
+struct TextView
 {
-	if (isValidNoteString(chordType)) return chordType;
+	const char* data;
+	size_t size;
 
-	string noteString = chordMap[chordType];
+	TextView() : data(""), size(0) {}
+	TextView(const char* data, size_t size) : data(data), size(size) {}
 
-	if (noteString.size() == 0)
-		noteString = scaleMap[chordType];
+	bool equals(const char* text) const { return size == strlen(text) && memcmp(data, text, size) == 0; }
+	bool endsWith(const char* text) const { size_t length = strlen(text); return size >= length && memcmp(data + size - length, text, length) == 0; }
+	size_t find(char c) const { const void* found = memchr(data, c, size); return found == NULL ? string::npos : (const char*)found - data; }
+	TextView substr(size_t start, size_t length = string::npos) const { return TextView(data + start, min(length, size - start)); }
+};
 
-	if (noteString.size() == 0)
-	{
-		cerr << "Unrecognized chord type: " << chordType << endl;
-		unrecognizedChordTypes = true;
+// Note names as spelled in a progression: 0 when there is none, otherwise 1 + 3 * letter + accidental (none, '#', 'b')
+// Mirrors getRoot(): a letter from A to G, optionally followed by an accidental
+uint8_t parseNoteName(TextView text)
+{
+	if (text.size == 0 || text.data[0] < 'A' || text.data[0] > 'G') return 0;
 
-		noteString = EMPTY_NOTE_STRING;
-	}
+	int accidental = 0;
+	if (text.size > 1 && text.data[1] == '#') accidental = 1;
+	else if (text.size > 1 && text.data[1] == 'b') accidental = 2;
 
-	return noteString;
+	return 1 + 3 * (text.data[0] - 'A') + accidental;
 }
 
-string transposeScale(string scale, string fromRoot, string toRoot)
+int getNoteNameLength(uint8_t noteName)
 {
-	if (scale.compare(EMPTY_NOTE_STRING) == 0) 
-		return scale;
-	
-	int fromRootIndex = getNoteIndex(fromRoot);
-	int toRootIndex = getNoteIndex(toRoot);
+	if (noteName == 0) return 0;
+	return (noteName - 1) % 3 == 0 ? 1 : 2;
+}
 
-	if (fromRootIndex >= 0 && toRootIndex >= 0)
-	{
-		// shift chord based on specified roots
+string getNoteName(uint8_t noteName)
+{
+	if (noteName == 0) return "";
 
-		int offset = toRootIndex - fromRootIndex;
-		if (offset < 0)	offset += NOTES_PER_OCTAVE;
+	string name(1, 'A' + (noteName - 1) / 3);
+	if ((noteName - 1) % 3 == 1) name += '#';
+	else if ((noteName - 1) % 3 == 2) name += 'b';
 
-		scale = shiftStringRight(scale, offset);
-	}
-	else
-	{
-		cerr << "ERROR - transposeScale(): One or both root notes unrecognized: " << endl;
-		cerr << "fromRoot: " << fromRoot << endl;
-		cerr << "toRoot: " << toRoot << endl;
-		cerr << "scale: " << scale << endl;
-		cerr << "No transposition will be done." << endl;
-		errorStatus = 3;
-	}
-	
-	return scale;
+	return name;
 }
 
-string addBassNoteToScale(string scale, string bassNote)
+// Appends a symbol assembled from up to four pieces of text and parses its root, bass and chord type
+ChordSymbol addChordSymbol(Song& song, map<string, uint16_t>& chordTypeIndices, TextView a, TextView b = TextView(), TextView c = TextView(), TextView d = TextView())
 {
-	int bassIndex = getNoteIndex(bassNote);
+	ChordSymbol symbol;
+	symbol.text = song.symbolText.size();
 
-	if (bassIndex >= 0)
-	{
-		// add bass note if not present in chord
-		if (scale[bassIndex] == '0') scale[bassIndex] = '1';
-	}
-	else
+	song.symbolText.append(a.data, a.size).append(b.data, b.size).append(c.data, c.size).append(d.data, d.size);
+	TextView text(song.symbolText.data() + symbol.text, song.symbolText.size() - symbol.text);
+
+	symbol.root = parseNoteName(text);
+
+	size_t indexOfSlash = text.find('/');
+	symbol.bass = indexOfSlash == string::npos ? symbol.root : parseNoteName(text.substr(indexOfSlash + 1));
+
+	// the chord type lies between the root and the first slash, a blank chord type implies major
+	TextView type = text.substr(getNoteNameLength(symbol.root));
+	if (indexOfSlash != string::npos) type = text.substr(getNoteNameLength(symbol.root), indexOfSlash - getNoteNameLength(symbol.root));
+	string chordType = type.size > 0 ? string(type.data, type.size) : "M";
+
+	map<string, uint16_t>::const_iterator it = chordTypeIndices.find(chordType);
+	if (it == chordTypeIndices.end())
 	{
-		if (debugMode)
-		{
-			cerr << "WARNING - addBassNoteToScale(): Bass note unrecognized: " << endl;
-			cerr << "bassNote: " << bassNote << endl;
-			cerr << "scale: " << scale << endl;
-			cerr << "No modification will be done." << endl;
-		}
+		it = chordTypeIndices.insert(make_pair(chordType, (uint16_t)song.chordTypes.size())).first;
+		song.chordTypes.push_back(chordType);
 	}
+	symbol.type = it->second;
 
-	return scale;
+	song.symbolText.push_back('\0');
+
+	return symbol;
 }
 
-string generateScale(int index, vector<string> progression)
+string getSymbolText(const Song& song, const ChordSymbol& symbol)
 {
-	string scale = getChordNoteString(getChordType(progression[index]));
-	scale = transposeScale(scale, "C", getRoot(progression[index]));
-	scale = addBassNoteToScale(scale, getBass(progression[index]));
-	return scale;
+	return string(song.symbolText.c_str() + symbol.text);
+}
+
+void reportParseError(const Song& song, const string& message, int lineNumber, int column)
+{
+	cerr << "ERROR: " << message << " at line " << lineNumber << ", column " << column << " of input file: " << song.inputFilename << endl;
 }
 
-void generateNoteProgression() 
+// Reads the second whitespace separated word of a line as a number, the way "Tempo: 120 BPM" is written
+bool parseTempo(TextView line, int& beatsPerMinute, size_t& column)
 {
-	for (int i = 0; i < chordProgression.size(); i++)
+	size_t i = 0;
+	while (i < line.size && isspace(line.data[i])) i++;
+	while (i < line.size && !isspace(line.data[i])) i++;
+	while (i < line.size && isspace(line.data[i])) i++;
+
+	column = i;
+
+	bool negative = i < line.size && line.data[i] == '-';
+	if (i < line.size && (line.data[i] == '-' || line.data[i] == '+')) i++;
+
+	if (i >= line.size || !isdigit(line.data[i])) return false;
+
+	int value = 0;
+	while (i < line.size && isdigit(line.data[i])) value = value * 10 + (line.data[i++] - '0');
+
+	beatsPerMinute = negative ? -value : value;
+	return true;
+}
+
+// State shared by the input file parsers while they fill in a song's progressions
+struct ProgressionParser
+{
+	map<string, uint16_t> chordTypeIndices;
+	ChordSymbol emptyScale;
+	bool emptyScaleAdded;
+
+	ProgressionParser() : emptyScaleAdded(false) {}
+};
+
+ChordSymbol getEmptyScale(Song& song, ProgressionParser& parser)
+{
+	if (!parser.emptyScaleAdded)
 	{
-		string notesInChord = generateScale(i, chordProgression);
-		string notesInScale = generateScale(i, scaleProgression);
-		
-		if (ignoreScales)
-			notesInScale = EMPTY_NOTE_STRING;
+		parser.emptyScale = addChordSymbol(song, parser.chordTypeIndices, TextView("empty", 5));
+		parser.emptyScaleAdded = true;
+	}
+
+	return parser.emptyScale;
+}
 
-		noteProgression.push_back(combineChords(notesInChord, notesInScale));
+// Appends a segment starting where the song currently ends
+void addSegment(Song& song, ChordSymbol chord, ChordSymbol scale, int64_t duration)
+{
+	ProgressionSegment segment;
+	segment.chord = chord;
+	segment.scale = scale;
+	segment.startTick = song.numTicks;
+	segment.duration = duration;
+
+	song.progression.push_back(segment);
+	song.numTicks += duration;
+}
+
+// Holds the last chord for longer
+void extendLastSegment(Song& song, int64_t duration)
+{
+	song.progression.back().duration += duration;
+	song.numTicks += duration;
+}
+
+// Plays the part of the song from startTick to its current end count times in total
+void repeatSection(Song& song, int64_t startTick, int count)
+{
+	if (startTick >= song.numTicks) return;
+
+	// last segment starting at or before the section, it may have started before the section did
+	size_t first = 0;
+	for (size_t lo = 0, hi = song.progression.size(); lo < hi;)
+	{
+		size_t mid = (lo + hi) / 2;
+		if (song.progression[mid].startTick <= startTick)
+		{
+			first = mid;
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
 	}
 
-	if (unrecognizedChordTypes) 
+	size_t last = song.progression.size();
+
+	for (int i = 1; i < count; i++)
 	{
-		cerr << endl << "ERROR: MIDI file could not be generated. Please update the chord list to include the missing chord types for this song." << endl;
-		end(1);
+		for (size_t s = first; s < last; s++)
+		{
+			ProgressionSegment segment = song.progression[s]; // copied, adding segments may reallocate
+			int64_t start = max(segment.startTick, startTick);
+			addSegment(song, segment.chord, segment.scale, segment.startTick + segment.duration - start);
+		}
 	}
 }
 
-void separateNotesOfChordChange(int indexOfFirstChord, int indexOfSecondChord, bool oddToEven)
+// Adds one chord lasting duration ticks, optionally followed by '_' and its scale
+// A chord without a root is in C, a scale without a root takes the root (and slash bass) of its chord, a chord without a scale gets the "empty" scale
+void addProgressionWord(Song& song, ProgressionParser& parser, TextView word, int64_t duration)
 {
-		string firstChord = noteProgression[indexOfFirstChord];
-		string secondChord = noteProgression[indexOfSecondChord];
-		
-		string notesByChannel[NUM_CHANNELS];
-		for (int i = 0; i < NUM_CHANNELS; i++)
+	const TextView DEFAULT_ROOT("C", 1);
+	const TextView SLASH("/", 1);
+
+	size_t indexOfUnderscore = word.find('_');
+	TextView chord = word.substr(0, indexOfUnderscore);
+
+	TextView chordRoot = DEFAULT_ROOT; // default to root of C if none specified
+	if (parseNoteName(chord) != 0) chordRoot = TextView();
+
+	ChordSymbol chordSymbol = addChordSymbol(song, parser.chordTypeIndices, chordRoot, chord);
+	ChordSymbol scaleSymbol;
+
+	if (indexOfUnderscore != string::npos)
+	{
+		// everything before '_' is chord, everything after '_' is scale
+		TextView scale = word.substr(indexOfUnderscore + 1);
+
+		TextView scaleRoot; // append root of chord to scale name if none specified
+		string chordRootName = getNoteName(chordSymbol.root);
+		if (parseNoteName(scale) == 0) scaleRoot = TextView(chordRootName.data(), chordRootName.size());
+
+		// need to append bass note to scale if specified for chord but not for scale
+		if (scale.find('/') == string::npos && chord.find('/') != string::npos)
 		{
-			notesByChannel[i] = EMPTY_NOTE_STRING;
+			string chordBassName = getNoteName(chordSymbol.bass);
+			scaleSymbol = addChordSymbol(song, parser.chordTypeIndices, scaleRoot, scale, SLASH, TextView(chordBassName.data(), chordBassName.size()));
 		}
-		
-		for (int i = 0; i < firstChord.size(); i++)
+		else
+		{
+			scaleSymbol = addChordSymbol(song, parser.chordTypeIndices, scaleRoot, scale);
+		}
+	}
+	else
+	{
+		scaleSymbol = getEmptyScale(song, parser);
+	}
+
+	addSegment(song, chordSymbol, scaleSymbol, duration);
+}
+
+// Returns the next line of a mapped file and advances lineStart past it
+TextView getNextLine(const char* data, size_t size, size_t& lineStart)
+{
+	size_t lineEnd = lineStart;
+	while (lineEnd < size && data[lineEnd] != '\n') lineEnd++;
+
+	TextView line(data + lineStart, lineEnd - lineStart);
+	while (line.size > 0 && line.data[line.size-1] == '\r') line.size--; // get rid of windows carriage returns
+
+	lineStart = lineEnd + 1;
+	return line;
+}
+
+bool loadCPSfile(Song& song)
+{
+	// Single pass over the memory-mapped file:
+	// Before the "Chords:" line, look for the tempo
+	// After it, every space separated word is a chord (see addProgressionWord()), a bar line or a repeat of the previous chord
+
+	char* data;
+	size_t size;
+
+	if (!mapInputFile(song.inputFilename, data, size))
+	{
+		cerr << "ERROR: Could not read input file: " << song.inputFilename << endl;
+		song.errorStatus = 2;
+		return false;
+	}
+
+	ProgressionParser parser;
+	bool foundChordsSection = false;
+	bool parsed = true;
+	int lineNumber = 0;
+
+	for (size_t lineStart = 0; lineStart < size && parsed;)
+	{
+		TextView line = getNextLine(data, size, lineStart);
+		lineNumber++;
+
+		if (foundChordsSection)
 		{
-			if (firstChord[i] > '0') // note is active
+			for (size_t wordStart = 0; wordStart < line.size; )
 			{
-				if (secondChord[i] > '0')
+				if (line.data[wordStart] == ' ')
+				{
+					wordStart++;
+					continue;
+				}
+
+				size_t wordEnd = wordStart;
+				while (wordEnd < line.size && line.data[wordEnd] != ' ') wordEnd++;
+
+				TextView word = line.substr(wordStart, wordEnd - wordStart);
+				int column = wordStart + 1;
+				wordStart = wordEnd;
+
+				if (word.equals("|"))
 				{
-					// chord change shares this note
-					notesByChannel[MIXED_CHORD_CHANNEL][i] = firstChord[i];
+					// skip
+					continue;
 				}
-				else // this note is only in first chord
+				else if (word.equals(".") || word.equals("/"))
 				{
-					if (oddToEven)
-					{
-						notesByChannel[ODD_CHORD_CHANNEL][i] = firstChord[i];
-					}
-					else // even to odd
+					// repeat
+					if (song.progression.empty())
 					{
-						notesByChannel[EVEN_CHORD_CHANNEL][i] = firstChord[i];
+						reportParseError(song, "Repeat '" + string(word.data, word.size) + "' before the first chord", lineNumber, column);
+						parsed = false;
+						break;
 					}
+
+					extendLastSegment(song, TICKS_PER_QUARTER_NOTE);
+				}
+				else
+				{
+					addProgressionWord(song, parser, word, TICKS_PER_QUARTER_NOTE);
 				}
 			}
 		}
 		
-		if (indicateBass)
+		else if (line.endsWith("BPM"))
 		{
-			int indexOfBassNote = getNoteIndex(getBass(chordProgression[indexOfFirstChord]));
-			notesByChannel[BASS_NOTE_CHANNEL][indexOfBassNote] = firstChord[indexOfBassNote];
-			notesByChannel[ODD_CHORD_CHANNEL][indexOfBassNote] = '0';
-			notesByChannel[EVEN_CHORD_CHANNEL][indexOfBassNote] = '0';
-			notesByChannel[MIXED_CHORD_CHANNEL][indexOfBassNote] = '0';
+			size_t column;
+			if (!parseTempo(line, song.beatsPerMinute, column))
+			{
+				reportParseError(song, "Invalid tempo", lineNumber, column + 1);
+				parsed = false;
+			}
 		}
 		
-		// fill in all bars of the first chord
-		for (int beat = indexOfFirstChord; beat != indexOfSecondChord && beat < noteProgression.size(); beat++)
+		else if (line.equals("Chords:"))
 		{
-			for (int channel = 0; channel < NUM_CHANNELS; channel++)
-			{
-				noteProgressionByChannel[channel][beat] = notesByChannel[channel];
-			}
+			foundChordsSection = true;
 		}
+	}
+
+	unmapInputFile(data, size);
+
+	if (!parsed)
+	{
+		song.errorStatus = 2;
+		return false;
+	}
+		
+	if (song.beatsPerMinute == 0)
+	{
+		cerr << "ERROR: No tempo found in input file: " << song.inputFilename << endl;
+		song.errorStatus = 2;
+		return false;
+	}
+
+	return true;
 }
 
-void separateNoteProgressionByChannel()
+bool equalsIgnoreCase(TextView text, const char* other)
 {
-	// Compare each chord to the chord that comes next
-	// Move shared notes to channel 3
-	// Move private notes to channel 1/2 (alternating each chord change)
-	// eg. CM7_'ionian to Cm7_'aeolian
-	// 201021020102 -> [000020000102] [] [201001020000]
-	
-	// initialize noteProgressionByChannel
-	for (int channel = 0; channel < NUM_CHANNELS; channel++)
+	size_t length = strlen(other);
+	if (text.size != length) return false;
+
+	for (size_t i = 0; i < length; i++)
 	{
-		for (int beat = 0; beat < noteProgression.size(); beat++)
-			noteProgressionByChannel[channel].push_back(EMPTY_NOTE_STRING);
+		if (tolower(text.data[i]) != tolower(other[i])) return false;
 	}
-	
-	bool isOddToEvenChordChange = true; // keep track of odd/even parity for each chord change
-	
-	for (int indexOfCurrentChord = 0; indexOfCurrentChord < noteProgression.size();)
+
+	return true;
+}
+
+// MMA commands that only change how the accompaniment is played, they don't affect the chords
+const char* const IGNORED_MMA_DIRECTIVES[] =
+{
+	"Groove", "Swingmode", "Volume", "Seqsize", "Keysig", "Transpose", "Cresc", "Decresc", "Rtime", "Rvolume",
+	"Accent", "AllTracks", "Articulate", "AutoSoloTracks", "Comment", "Debug", "DefGroove", "Delete", "Doc", "Include",
+	"Lyric", "MidiMark", "Mset", "Mute", "Octave", "Print", "Seq", "SeqClear", "SeqRnd", "Set", "Use", "Voicing"
+};
+
+// MMA tracks, commands for them are written "Track Command" or "Track-Name Command"
+const char* const MMA_TRACK_TYPES[] = { "Chord", "Bass", "Drum", "Walk", "Arpeggio", "Scale", "Solo", "Melody", "Aria", "Plectrum" };
+
+bool isIgnoredMMAcommand(TextView word)
+{
+	for (size_t i = 0; i < sizeof(IGNORED_MMA_DIRECTIVES) / sizeof(IGNORED_MMA_DIRECTIVES[0]); i++)
 	{
-		// look ahead until we find next chord change (first chord that is different from the current)
-		
-		int indexOfNextChord;
-		for (indexOfNextChord = indexOfCurrentChord + 1; indexOfNextChord < noteProgression.size() && noteProgression[indexOfCurrentChord].compare(noteProgression[indexOfNextChord]) == 0 && (!indicateBass || getBass(chordProgression[indexOfCurrentChord]).compare(getBass(chordProgression[indexOfNextChord])) == 0); indexOfNextChord++);
-		
-		if (indexOfNextChord >= noteProgression.size()) // we're currently completing the last chord
+		if (equalsIgnoreCase(word, IGNORED_MMA_DIRECTIVES[i])) return true;
+	}
+
+	TextView track = word.substr(0, word.find('-'));
+	for (size_t i = 0; i < sizeof(MMA_TRACK_TYPES) / sizeof(MMA_TRACK_TYPES[0]); i++)
+	{
+		if (equalsIgnoreCase(track, MMA_TRACK_TYPES[i])) return true;
+	}
+
+	return false;
+}
+
+// Splits a line into space or tab separated words, stopping at a "//" comment
+vector<TextView> getMMAwords(TextView line)
+{
+	vector<TextView> words;
+
+	for (size_t wordStart = 0; wordStart < line.size; )
+	{
+		if (line.data[wordStart] == ' ' || line.data[wordStart] == '\t')
+		{
+			wordStart++;
+			continue;
+		}
+
+		size_t wordEnd = wordStart;
+		while (wordEnd < line.size && line.data[wordEnd] != ' ' && line.data[wordEnd] != '\t') wordEnd++;
+
+		TextView word = line.substr(wordStart, wordEnd - wordStart);
+		if (word.size >= 2 && word.data[0] == '/' && word.data[1] == '/') break; // comment
+
+		words.push_back(word);
+		wordStart = wordEnd;
+	}
+
+	return words;
+}
+
+bool parseNumber(TextView word, int& number)
+{
+	if (word.size == 0) return false;
+
+	number = 0;
+	for (size_t i = 0; i < word.size; i++)
+	{
+		if (!isdigit(word.data[i])) return false;
+		number = number * 10 + (word.data[i] - '0');
+	}
+
+	return true;
+}
+
+bool loadMMAfile(Song& song)
+{
+	// Single pass over the memory-mapped file, reading the chords of each bar and the commands that change them:
+	// [bar number] chord chord ... [* count]	a bar, '/' repeats the previous chord and 'z' is a rest
+	// Tempo <bpm>, Time <beats per bar>		song settings
+	// Repeat ... RepeatEnd [count]			repeated section (played twice by default)
+	// Groove, Swingmode, track settings		accompaniment only, ignored
+	//
+	// Chords fill a bar the way MMA plays them: one chord per beat, except that two chords in a bar with an even
+	// number of beats split it in half and the last chord lasts until the end of the bar
+
+	char* data;
+	size_t size;
+
+	if (!mapInputFile(song.inputFilename, data, size))
+	{
+		cerr << "ERROR: Could not read input file: " << song.inputFilename << endl;
+		song.errorStatus = 2;
+		return false;
+	}
+
+	ProgressionParser parser;
+	bool parsed = true;
+	int lineNumber = 0;
+	int beatsPerBar = 4;
+	bool inBlock = false; // inside a Begin/End block, which only holds track settings
+	int64_t repeatStart = -1; // first tick of the section being repeated
+
+	for (size_t lineStart = 0; lineStart < size && parsed;)
+	{
+		TextView line = getNextLine(data, size, lineStart);
+		lineNumber++;
+
+		vector<TextView> words = getMMAwords(line);
+		if (words.empty()) continue;
+
+		TextView command = words[0];
+		int column = command.data - line.data + 1;
+
+		if (inBlock)
+		{
+			if (equalsIgnoreCase(command, "End")) inBlock = false;
+		}
+		else if (equalsIgnoreCase(command, "Begin"))
+		{
+			inBlock = true;
+		}
+		else if (equalsIgnoreCase(command, "Tempo"))
 		{
-			if (indexOfCurrentChord == 0) // there are no chord changes
+			int bpm;
+			if (words.size() < 2 || !parseNumber(words[1], bpm) || bpm == 0)
 			{
-				// Put all notes on same channel
-				for (int i = 0; i < noteProgression.size(); i++)
-				{
-					noteProgressionByChannel[ODD_CHORD_CHANNEL][i] = noteProgression[i];
-					noteProgressionByChannel[EVEN_CHORD_CHANNEL][i] = EMPTY_NOTE_STRING;
-					noteProgressionByChannel[MIXED_CHORD_CHANNEL][i] = EMPTY_NOTE_STRING;
-					noteProgressionByChannel[BASS_NOTE_CHANNEL][i] = EMPTY_NOTE_STRING;
-					if (indicateBass)
-					{
-						int indexOfBassNote = getNoteIndex(getBass(chordProgression[i]));
-						noteProgressionByChannel[BASS_NOTE_CHANNEL][i][indexOfBassNote] = noteProgression[i][indexOfBassNote];
-						noteProgressionByChannel[ODD_CHORD_CHANNEL][i][indexOfBassNote] = '0';
-					}
-				}
+				reportParseError(song, "Tempo must be a number of beats per minute", lineNumber, column);
+				parsed = false;
+			}
+			else if (song.beatsPerMinute == 0)
+			{
+				song.beatsPerMinute = bpm;
+			}
+			else if (song.beatsPerMinute != bpm)
+			{
+				cerr << "WARNING: Ignoring tempo change to " << bpm << " BPM at line " << lineNumber << " of input file: " << song.inputFilename << endl;
+			}
+		}
+		else if (equalsIgnoreCase(command, "Time") || equalsIgnoreCase(command, "TimeSig"))
+		{
+			if (words.size() < 2 || !parseNumber(words[1], beatsPerBar) || beatsPerBar == 0)
+			{
+				reportParseError(song, "Time must be a number of beats per bar", lineNumber, column);
+				parsed = false;
+			}
+		}
+		else if (equalsIgnoreCase(command, "Repeat"))
+		{
+			if (repeatStart >= 0)
+			{
+				reportParseError(song, "Nested repeats are not supported", lineNumber, column);
+				parsed = false;
+			}
+			repeatStart = song.numTicks;
+		}
+		else if (equalsIgnoreCase(command, "RepeatEnd") || equalsIgnoreCase(command, "EndRepeat"))
+		{
+			int count = 2;
+			if (repeatStart < 0)
+			{
+				reportParseError(song, "RepeatEnd without Repeat", lineNumber, column);
+				parsed = false;
+			}
+			else if (words.size() > 1 && !parseNumber(words[1], count))
+			{
+				reportParseError(song, "RepeatEnd count must be a number", lineNumber, column);
+				parsed = false;
+			}
+			else
+			{
+				repeatSection(song, repeatStart, count);
+				repeatStart = -1;
+			}
+		}
+		else if (equalsIgnoreCase(command, "RepeatEnding"))
+		{
+			reportParseError(song, "Repeat endings are not supported", lineNumber, column);
+			parsed = false;
+		}
+		else if (isIgnoredMMAcommand(command))
+		{
+			if (debugMode)
+			{
+				cout << "Ignoring MMA command '" << string(command.data, command.size) << "' at line " << lineNumber << endl;
+			}
+		}
+		else
+		{
+			// a bar: optional bar number, chords, optional "* count"
+			size_t firstChord = 0;
+			int barNumber;
+			if (parseNumber(words[0], barNumber)) firstChord = 1;
+
+			size_t lastChord = words.size();
+			int barCount = 1;
+			if (lastChord >= firstChord + 2 && words[lastChord-2].equals("*") && parseNumber(words[lastChord-1], barCount)) lastChord -= 2;
+			else if (lastChord > firstChord && words[lastChord-1].size > 1 && words[lastChord-1].data[0] == '*' && parseNumber(words[lastChord-1].substr(1), barCount)) lastChord -= 1;
+
+			int numChords = lastChord - firstChord;
+			int64_t barStart = song.numTicks;
+
+			if (numChords == 0) continue; // bar number only
+
+			if (numChords > beatsPerBar)
+			{
+				reportParseError(song, "More chords than beats in bar", lineNumber, words[firstChord].data - line.data + 1);
+				parsed = false;
+				break;
 			}
-			else // there are chord changes
+
+			for (int i = 0; i < numChords && parsed; i++)
 			{
-				if (loopMode)
+				TextView word = words[firstChord + i];
+				int wordColumn = word.data - line.data + 1;
+
+				int beats = 1;
+				if (numChords == 2 && beatsPerBar % 2 == 0) beats = beatsPerBar / 2;
+				else if (i == numChords - 1) beats = beatsPerBar - i;
+
+				if (word.equals("/"))
 				{
-					// need to transistion to a chord and use different colors
-					
-					// if first and last chord same
-					if (noteProgression[0].compare(noteProgression[noteProgression.size()-1]) == 0)
+					if (song.progression.empty())
 					{
-						indexOfNextChord = chordChanges[0];
+						reportParseError(song, "Repeat '/' before the first chord", lineNumber, wordColumn);
+						parsed = false;
+						break;
 					}
-					else // first and last chord different
-					{
-						// transistion to first chord
-						indexOfNextChord = 0;
-						chordChanges.push_back(0); // indicate a chord change to first chord
-					}
-					
-					separateNotesOfChordChange(indexOfCurrentChord, indexOfNextChord, isOddToEvenChordChange);
+
+					extendLastSegment(song, beats * TICKS_PER_QUARTER_NOTE);
+				}
+				else if (equalsIgnoreCase(word, "z") || equalsIgnoreCase(word, "z!"))
+				{
+					// rest: no chord is lit
+					addSegment(song, getEmptyScale(song, parser), getEmptyScale(song, parser), beats * TICKS_PER_QUARTER_NOTE);
+				}
+				else if (word.find('@') != string::npos || word.data[0] == '{' || word.data[0] == '[')
+				{
+					reportParseError(song, "Beat positions, lyrics and riffs in bars are not supported", lineNumber, wordColumn);
+					parsed = false;
+					break;
+				}
+				else if (parseNoteName(word) == 0)
+				{
+					reportParseError(song, "Unrecognized MMA command or chord '" + string(word.data, word.size) + "'", lineNumber, wordColumn);
+					parsed = false;
 					break;
 				}
 				else
 				{
-					// use same color
-					for (int i = indexOfCurrentChord; i < noteProgression.size(); i++)
-					{
-						if (isOddToEvenChordChange)
-						{
-							noteProgressionByChannel[ODD_CHORD_CHANNEL][i] = noteProgression[i];
-							noteProgressionByChannel[EVEN_CHORD_CHANNEL][i] = EMPTY_NOTE_STRING;
-						}
-						else // even to odd
-						{
-							noteProgressionByChannel[EVEN_CHORD_CHANNEL][i] = noteProgression[i];
-							noteProgressionByChannel[ODD_CHORD_CHANNEL][i] = EMPTY_NOTE_STRING;
-						}
-						noteProgressionByChannel[MIXED_CHORD_CHANNEL][i] = EMPTY_NOTE_STRING;
-						noteProgressionByChannel[BASS_NOTE_CHANNEL][i] = EMPTY_NOTE_STRING;
-						if (indicateBass)
-						{
-							int indexOfBassNote = getNoteIndex(getBass(chordProgression[i]));
-							noteProgressionByChannel[BASS_NOTE_CHANNEL][i][indexOfBassNote] = noteProgression[i][indexOfBassNote];
-							noteProgressionByChannel[ODD_CHORD_CHANNEL][i][indexOfBassNote] = '0';
-							noteProgressionByChannel[EVEN_CHORD_CHANNEL][i][indexOfBassNote] = '0';
-							noteProgressionByChannel[MIXED_CHORD_CHANNEL][i][indexOfBassNote] = '0';
-						}
-					}
+					addProgressionWord(song, parser, word, beats * TICKS_PER_QUARTER_NOTE);
 				}
 			}
-			break; // finished separating notes into channels for each chord
-		} 
-		
-		// create transition for non-final chord change
-		
-		chordChanges.push_back(indexOfNextChord);
-		
-		separateNotesOfChordChange(indexOfCurrentChord, indexOfNextChord, isOddToEvenChordChange);
-		
-		toggle(isOddToEvenChordChange);
-		indexOfCurrentChord = indexOfNextChord; // point to next chord
+
+			if (parsed) repeatSection(song, barStart, barCount);
+		}
 	}
-}
 
-// adds a MIDI message issusing the set_tempo command to the specified BPM
-void setTempo(int bpm)
-{
-	/*
-	unsigned char statusByte = 0xFF; // meta message
-	unsigned char metaByte = 0x51; // set tempo message
-	unsigned char lengthByte = 0x04; // tempo stored in 4 bytes
-	
-	uint32_t microsecondsPerQuarterNote = getMicrosecondsPerBeat(bpm);
-	
-	// construct message byte array
-	vector<unsigned char> setTempoMessage;
-	setTempoMessage.push_back(statusByte);
-	setTempoMessage.push_back(metaByte);
-	setTempoMessage.push_back(lengthByte);
-	for (int i = int(lengthByte) - 1; i >= 0; i--)
+	unmapInputFile(data, size);
+
+	if (parsed && repeatStart >= 0)
 	{
-		unsigned char tempoByte = *((unsigned char*)&microsecondsPerQuarterNote+i);
-		setTempoMessage.push_back(tempoByte);
+		cerr << "ERROR: Repeat without RepeatEnd in input file: " << song.inputFilename << endl;
+		parsed = false;
 	}
-	
+
+	if (!parsed)
+	{
+		song.errorStatus = 2;
+		return false;
+	}
+
+	if (song.beatsPerMinute == 0)
+	{
+		song.beatsPerMinute = 120; // MMA's default tempo
+	}
+
+	return true;
+}
+
+bool loadInput(Song& song)
+{	
+	switch (song.inputFileType)
+	{
+		case TXT:
+			if (!loadCPSfile(song)) return false;
+			break;
+		case MMA:
+			if (!loadMMAfile(song)) return false;
+			break;
+	}
+
+	song.numBeats = song.numTicks / TICKS_PER_QUARTER_NOTE;
+	
+	if (song.progression.empty())
+	{
+		cerr << "No chords found in input file: " << song.inputFilename << endl;
+		song.errorStatus = 2;
+		return false;
+	}
+
+	return true;
+}
+
+// Synthetic progressions: random but reproducible CPS charts for measuring how rendering scales with song length
+
+// Chord or scale types that read back unchanged when written after a root in a progression word
+vector<string> getGeneratorTypes(const map<string, NoteSet>& types)
+{
+	vector<string> generatorTypes;
+
+	for (map<string, NoteSet>::const_iterator it = types.begin(); it != types.end(); it++)
+	{
+		const string& type = it->first;
+		if (type.size() == 0 || type[0] == '#' || type[0] == 'b' || type.compare("empty") == 0) continue;
+		if (type.find_first_of(" \t_/|") != string::npos) continue;
+
+		generatorTypes.push_back(type);
+	}
+
+	return generatorTypes;
+}
+
+bool getRandomChance(mt19937& random, double chance)
+{
+	return random() < chance * 4294967296.0;
+}
+
+string getRandomNoteName(mt19937& random)
+{
+	static const char* const NOTE_NAMES[] = { "C", "C#", "Db", "D", "D#", "Eb", "E", "F", "F#", "Gb", "G", "G#", "Ab", "A", "A#", "Bb", "B" };
+	return NOTE_NAMES[random() % (sizeof(NOTE_NAMES) / sizeof(NOTE_NAMES[0]))];
+}
+
+// Writes a chart of the requested length drawing chord types from the chord list and scale types from the scale list
+void generateProgressionFile(const string& filename)
+{
+	vector<string> chordTypes = getGeneratorTypes(chordMap);
+	vector<string> scaleTypes = getGeneratorTypes(scaleMap);
+
+	if (chordTypes.size() == 0 || scaleTypes.size() == 0)
+	{
+		cerr << "ERROR: No chord or scale types to generate a progression from." << endl;
+		errorStatus = 3;
+		return;
+	}
+
+	ofstream progressionFile(filename.c_str(), ios::binary);
+
+	progressionFile << "Session: [Generated, seed " << generatorSeed << "]" << endl << endl;
+	progressionFile << "Tempo: " << GENERATED_BPM << " BPM" << endl << endl;
+	progressionFile << "Chords:" << endl << endl;
+
+	mt19937 random(generatorSeed);
+	int64_t numChordChanges = 0;
+	string line;
+
+	for (int64_t beat = 0; beat < generatedBeats; beat++)
+	{
+		if (beat % BEATS_PER_BAR == 0) line += "| ";
+
+		if (beat == 0 || getRandomChance(random, chordChangeDensity))
+		{
+			line += getRandomNoteName(random) + chordTypes[random() % chordTypes.size()];
+			if (getRandomChance(random, slashChordRatio)) line += "/" + getRandomNoteName(random);
+			if (getRandomChance(random, scaleRatio)) line += "_" + scaleTypes[random() % scaleTypes.size()];
+			numChordChanges++;
+		}
+		else
+		{
+			line += ".";
+		}
+
+		line += " ";
+
+		if ((beat + 1) % (BEATS_PER_BAR * BARS_PER_LINE) == 0 || beat + 1 == generatedBeats)
+		{
+			progressionFile << line << "|" << endl << endl;
+			line.clear();
+		}
+	}
+
+	progressionFile.close();
+
+	if (!progressionFile)
+	{
+		cerr << "ERROR: Could not write generated progression: " << filename << endl;
+		errorStatus = 2;
+		return;
+	}
+
+	cout << endl << "Generated '" << filename << "': " << generatedBeats << " beats, " << numChordChanges << " chord changes (seed " << generatorSeed << ")." << endl << endl;
+}
+
+bool getInputFileType(const string& filename, InputFileType& fileType)
+{
+	if (endsWith(filename, ".txt")) fileType = TXT;
+	else if (endsWith(filename, ".mma")) fileType = MMA;
+	else return false;
+
+	return true;
+}
+
+void setInputFileType(string filename)
+{
+	if (!getInputFileType(filename, inputFileType))
+	{
+		stringstream ss;
+		ss << "ERROR: Unrecognized input file type for input file: " << filename;
+		cerr << ss.str() << endl;
+		errorStatus = 1;
+		end(errorStatus);
+	}
+}
+
+bool setIOFile(int argNumber, IOtype ioType)
+{
+	string arg = getArg(argNumber);
+	
+	switch (ioType)
+	{
+		case Input:
+			setInputFileType(arg);
+			inputFilename = arg;
+			break;
+		case Output:
+			outputFilename = arg;
+			break;
+	}
+}
+
+void setChordScaleMappingFile(int argNumber)
+{
+	chordScaleMappingFilename = getArg(argNumber);
+}
+
+void setInputFile(int argNumber)
+{
+	setIOFile(argNumber, Input);
+}
+
+void setOutputFile(int argNumber)
+{
+	setIOFile(argNumber, Output);
+}
+
+void rejectOptionValue(int argNumber)
+{
+	cerr << "ERROR: Invalid value for " << getArg(argNumber) << ": " << getArg(argNumber+1) << endl;
+	errorStatus = 1;
+	end(errorStatus);
+}
+
+// The argument following an option that requires a value
+string getOptionValue(int argNumber)
+{
+	if (argNumber+1 >= getArgCount())
+	{
+		cerr << "ERROR: No value specified for " << getArg(argNumber) << endl;
+		errorStatus = 1;
+		end(errorStatus);
+	}
+
+	return getArg(argNumber+1);
+}
+
+// Sets the octave range of a channel (or of every channel with "all") from "<channel>=<lowest>-<highest>"
+bool setChannelOctaves(const string& value)
+{
+	size_t equals = value.find('=');
+	if (equals == string::npos) return false;
+
+	string channelName = value.substr(0, equals);
+	int lowestOctave, highestOctave;
+	char trailing;
+	if (sscanf(value.c_str() + equals + 1, "%d-%d%c", &lowestOctave, &highestOctave, &trailing) != 2) return false;
+	if (lowestOctave < 0 || highestOctave < lowestOctave || highestOctave * NOTES_PER_OCTAVE > 127) return false;
+
+	PitchRange range = { NOTES_PER_OCTAVE * lowestOctave, NOTES_PER_OCTAVE * highestOctave };
+	bool found = false;
+
+	for (int channel = 0; channel < NUM_OUTPUT_CHANNELS; channel++)
+	{
+		if (channelName == "all" || channelName == OUTPUT_CHANNEL_NAMES[channel])
+		{
+			channelPitchRanges[channel] = range;
+			found = true;
+		}
+	}
+
+	return found;
+}
+
+// A chance from 0 to 1
+double getRatioOption(int argNumber)
+{
+	string value = getOptionValue(argNumber);
+
+	char* valueEnd;
+	double ratio = strtod(value.c_str(), &valueEnd);
+	if (*valueEnd != '\0' || !(ratio >= 0 && ratio <= 1)) rejectOptionValue(argNumber);
+
+	return ratio;
+}
+
+bool processOption(int argNumber)
+{
+	string arg = getArg(argNumber);
+
+	if (arg.compare(REALTIME_OPTION) == 0)
+	{
+		realtimeMode = true;
+		if (argNumber+1 < getArgCount())
+		{
+			setChordScaleMappingFile(argNumber+1);
+			return true;
+		}
+	}	
+	else if (arg.compare(COMPILE_CONFIG_OPTION) == 0)
+	{
+		compileConfigMode = true;
+		if (argNumber+1 < getArgCount() && getArg(argNumber+1)[0] != '-')
+		{
+			setChordScaleMappingFile(argNumber+1);
+			return true;
+		}
+	}
+	else if (arg.compare(EMBED_CONFIG_OPTION) == 0)
+	{
+		embedConfigMode = true;
+		if (argNumber+1 < getArgCount() && getArg(argNumber+1)[0] != '-')
+		{
+			setChordScaleMappingFile(argNumber+1);
+			return true;
+		}
+	}
+	else if (arg.compare(BATCH_OPTION) == 0)
+	{
+		if (argNumber+1 < getArgCount())
+		{
+			batchFilename = getArg(argNumber+1);
+			return true;
+		}
+		cerr << "ERROR: No directory or list file specified for " << BATCH_OPTION << endl;
+		errorStatus = 1;
+		end(errorStatus);
+	}
+	else if (arg.compare(RENDER_CACHE_OPTION) == 0)
+	{
+		renderCacheDirectory = DEFAULT_RENDER_CACHE_DIRECTORY;
+		if (argNumber+1 < getArgCount() && getArg(argNumber+1)[0] != '-')
+		{
+			renderCacheDirectory = getArg(argNumber+1);
+			return true;
+		}
+	}
+#ifdef BENCHMARK
+	else if (arg.compare(BENCHMARK_OPTION) == 0)
+	{
+		benchmarkMode = true;
+		if (argNumber+1 < getArgCount() && getArg(argNumber+1)[0] != '-')
+		{
+			benchmarkFilename = getArg(argNumber+1);
+			return true;
+		}
+	}
+#endif
+	else if (arg.compare(VARY_SCALES_OPTION) == 0)
+	{
+		varyScales = true;
+		if (argNumber+1 < getArgCount() && getArg(argNumber+1)[0] != '-')
+		{
+			scaleVariationSeed = strtoul(getArg(argNumber+1).c_str(), NULL, 10);
+			return true;
+		}
+	}
+	else if (arg.compare(RUNNING_STATUS_OPTION) == 0)
+	{
+		runningStatus = true;
+	}
+	else if (arg.compare(COMPACT_FRAMES_OPTION) == 0)
+	{
+		compactFrames = true;
+	}
+	else if (arg.compare(PLAY_OPTION) == 0)
+	{
+		playMode = true;
+	}
+	else if (arg.compare(LINK_RATE_OPTION) == 0)
+	{
+		scheduleOutput = true;
+		if (argNumber+1 < getArgCount() && getArg(argNumber+1)[0] != '-')
+		{
+			linkBaudRate = atoi(getArg(argNumber+1).c_str());
+			if (linkBaudRate <= 0) rejectOptionValue(argNumber);
+			return true;
+		}
+	}
+	else if (arg.compare(OCTAVES_OPTION) == 0)
+	{
+		if (!setChannelOctaves(getOptionValue(argNumber))) rejectOptionValue(argNumber);
+		return true;
+	}
+	else if (arg.compare(GENERATE_OPTION) == 0)
+	{
+		if (argNumber+1 < getArgCount())
+		{
+			generatedFilename = getArg(argNumber+1);
+			return true;
+		}
+		cerr << "ERROR: No output file specified for " << GENERATE_OPTION << endl;
+		errorStatus = 1;
+		end(errorStatus);
+	}
+	else if (arg.compare(GENERATED_BEATS_OPTION) == 0)
+	{
+		string value = getOptionValue(argNumber);
+
+		char* valueEnd;
+		generatedBeats = strtoll(value.c_str(), &valueEnd, 10);
+		if (*valueEnd != '\0' || generatedBeats < 1 || generatedBeats > MAX_GENERATED_BEATS) rejectOptionValue(argNumber);
+		return true;
+	}
+	else if (arg.compare(CHORD_CHANGE_DENSITY_OPTION) == 0)
+	{
+		chordChangeDensity = getRatioOption(argNumber);
+		return true;
+	}
+	else if (arg.compare(SLASH_CHORD_RATIO_OPTION) == 0)
+	{
+		slashChordRatio = getRatioOption(argNumber);
+		return true;
+	}
+	else if (arg.compare(SCALE_RATIO_OPTION) == 0)
+	{
+		scaleRatio = getRatioOption(argNumber);
+		return true;
+	}
+	else if (arg.compare(SEED_OPTION) == 0)
+	{
+		generatorSeed = strtoul(getOptionValue(argNumber).c_str(), NULL, 10);
+		return true;
+	}
+	else if (arg.compare(INPUT_FILE_OPTION) == 0)
+	{
+		setInputFile(argNumber+1);
+		return true;
+	}	
+	else if (arg.compare(OUTPUT_FILE_OPTION) == 0)
+	{
+		setOutputFile(argNumber+1);
+		return true;
+	}
+	else if (arg.compare(LOOP_MODE_OPTION) == 0)
+	{
+		toggle(loopMode);
+	}	
+	else if (arg.compare(DEBUG_OPTION) == 0)
+	{
+		toggle(debugMode);
+	}
+	else if (arg.compare(BRIGHT_MODE_OPTION) == 0)
+	{
+		toggle(brightMode);
+	}
+	else if (arg.compare(INDICATE_BASS_OPTION) == 0)
+	{
+		toggle(indicateBass);
+	}
+	else if (arg.compare(CHORDS_ONLY_OPTION) == 0)
+	{
+		toggle(ignoreScales);
+	}
+	else if (arg.compare(ALL_CHORD_SIZES_OPTION) == 0)
+	{
+		toggle(allChordSizes);
+	}
+	else
+	{
+		stringstream ss;
+		ss << "ERROR: Unrecoginized command line argument #" << argNumber << ": " << arg;
+		cerr << ss.str() << endl;
+		errorStatus = 1;
+		end(errorStatus);
+	}
+	
+	return false;
+	
+}
+
+void loadChordMap(string filename, map<string, NoteSet>* forwardMap, map<NoteSet, string>* reverseMap)
+{
+	NoteSet mostRecentNotes;
+	vector<string> lines = getLines(filename);
+	for (int i = 0; i < lines.size(); i++)
+	{
+		string line = lines[i];
+		if (line.size() <= 0)
+			continue;
+			
+		string chordType = "";
+		string noteString = "";
+		
+		bool foundTab = false;
+		for (int j = 0; j < line.length(); j++) 
+		{
+			char c = line[j];
+			if (c == '\t') 
+			{
+				foundTab = true;
+			}
+			else if (foundTab)
+			{
+				noteString += c;
+			}
+			else
+			{
+				chordType += c;
+			}
+		}
+		
+		NoteSet notes;
+
+		if (noteString.compare(".") == 0)
+			notes = mostRecentNotes;
+		else if (parseNoteString(noteString, notes))
+			mostRecentNotes = notes;
+		else
+		{
+			cerr << "ERROR: In file '" << filename << "'" << endl;
+			cerr << "Note String " << noteString << " is not valid." << endl;
+			cerr << "Exiting..." << endl;
+			errorStatus = 3;
+			end(errorStatus);
+		}
+		
+		forwardMap->insert(pair<string, NoteSet>(chordType, notes));
+		reverseMap->insert(pair<NoteSet, string>(notes, chordType));
+	}
+}
+
+void loadConfig() 
+{
+	loadChordMap(CHORD_LIST_FILENAME, &chordMap, &reverseChordMap);
+	loadChordMap(SCALE_LIST_FILENAME, &scaleMap, &reverseScaleMap);
+}
+
+// Compiled config bundle
+// A single binary image of the chord and scale dictionaries plus the chord-scale table, written by --compile-config
+// Layout: header | chord names | scale names | chord-scale slots | scale masks | name characters
+
+const char CONFIG_BUNDLE_MAGIC[8] = { 'C', 'P', 'V', 'C', 'O', 'N', 'F', 'G' };
+const uint32_t CONFIG_BUNDLE_VERSION = 1;
+const int NUM_CONFIG_SOURCES = 3; // chords, scales, chord-scale mapping
+const int MAX_BUNDLE_FILENAME_LENGTH = 256;
+
+// identifies the version of a source file the bundle was compiled from
+struct ConfigSourceStamp
+{
+	int64_t size;
+	int64_t modifiedTime;
+};
+
+struct ConfigBundleHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t checksum; // FNV-1a of everything after the header
+	uint64_t payloadSize;
+	ConfigSourceStamp sources[NUM_CONFIG_SOURCES];
+	char chordScaleMappingFilename[MAX_BUNDLE_FILENAME_LENGTH];
+	uint32_t numChordNames;
+	uint32_t numScaleNames;
+	uint32_t numScaleMasks;
+	uint32_t namesSize;
+};
+
+struct ConfigBundleName
+{
+	uint32_t nameOffset; // into the name characters
+	uint16_t nameLength;
+	uint16_t lowBits;
+	uint16_t highBits;
+	uint16_t padding;
+};
+
+char* configBundleData = NULL;
+size_t configBundleSize = 0;
+
+uint32_t getChecksum(const char* data, size_t size)
+{
+	uint32_t hash = 2166136261u;
+
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= (unsigned char)data[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+ConfigSourceStamp getSourceStamp(const string& filename)
+{
+	ConfigSourceStamp stamp;
+	stamp.size = -1;
+	stamp.modifiedTime = -1;
+
+	struct stat fileInfo;
+	if (stat(filename.c_str(), &fileInfo) == 0)
+	{
+		stamp.size = fileInfo.st_size;
+		stamp.modifiedTime = fileInfo.st_mtime;
+	}
+
+	return stamp;
+}
+
+void getSourceStamps(const string& mappingFilename, ConfigSourceStamp* stamps)
+{
+	stamps[0] = getSourceStamp(CHORD_LIST_FILENAME);
+	stamps[1] = getSourceStamp(SCALE_LIST_FILENAME);
+	stamps[2] = getSourceStamp(mappingFilename);
+}
+
+void appendBundleNames(const map<string, NoteSet>& names, vector<ConfigBundleName>& entries, string& characters)
+{
+	for (map<string, NoteSet>::const_iterator it = names.begin(); it != names.end(); it++)
+	{
+		ConfigBundleName entry;
+		entry.nameOffset = characters.size();
+		entry.nameLength = it->first.size();
+		entry.lowBits = it->second.lowBits;
+		entry.highBits = it->second.highBits;
+		entry.padding = 0;
+
+		entries.push_back(entry);
+		characters += it->first;
+	}
+}
+
+// Builds a bundle image of the currently loaded dictionaries and chord-scale table
+string getConfigBundleImage(const string& mappingFilename)
+{
+	if (mappingFilename.size() >= MAX_BUNDLE_FILENAME_LENGTH)
+	{
+		cerr << "ERROR: Chord-scale mapping filename is too long to store in a config bundle: " << mappingFilename << endl;
+		errorStatus = 2;
+		end(errorStatus);
+	}
+
+	vector<ConfigBundleName> names;
+	string nameCharacters;
+	appendBundleNames(chordMap, names, nameCharacters);
+	appendBundleNames(scaleMap, names, nameCharacters);
+
+	string payload;
+	payload.append((const char*)names.data(), names.size() * sizeof(ConfigBundleName));
+	payload.append((const char*)chordScaleTable, NUM_NOTE_MASKS * sizeof(ChordScaleSlot));
+	payload.append((const char*)chordScaleMasks, numChordScaleMasks * sizeof(uint16_t));
+	payload += nameCharacters;
+
+	ConfigBundleHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CONFIG_BUNDLE_MAGIC, sizeof(header.magic));
+	header.version = CONFIG_BUNDLE_VERSION;
+	header.checksum = getChecksum(payload.data(), payload.size());
+	header.payloadSize = payload.size();
+	getSourceStamps(mappingFilename, header.sources);
+	strncpy(header.chordScaleMappingFilename, mappingFilename.c_str(), MAX_BUNDLE_FILENAME_LENGTH - 1);
+	header.numChordNames = chordMap.size();
+	header.numScaleNames = scaleMap.size();
+	header.numScaleMasks = numChordScaleMasks;
+	header.namesSize = nameCharacters.size();
+
+	return string((const char*)&header, sizeof(header)) + payload;
+}
+
+void writeConfigBundle(const string& filename, const string& mappingFilename)
+{
+	string image = getConfigBundleImage(mappingFilename);
+
+	ofstream bundleFile(filename.c_str(), ios::binary);
+	bundleFile.write(image.data(), image.size());
+	bundleFile.close();
+
+	if (!bundleFile)
+	{
+		cerr << "ERROR: Could not write config bundle: " << filename << endl;
+		errorStatus = 2;
+		end(errorStatus);
+	}
+}
+
+// Writes the bundle image as a C++ array, to be compiled in with -D EMBEDDED_CONFIG (see 'make embedded')
+void writeConfigHeader(const string& filename, const string& mappingFilename)
+{
+	string image = getConfigBundleImage(mappingFilename);
+
+	ofstream headerFile(filename.c_str());
+	headerFile << "// Generated by chordPROvisor " << EMBED_CONFIG_OPTION << " from '" << CHORD_LIST_FILENAME << "', '" << SCALE_LIST_FILENAME << "' and '" << mappingFilename << "'. Do not edit." << endl;
+	headerFile << endl;
+	headerFile << "alignas(8) static const unsigned char EMBEDDED_CONFIG_BUNDLE[] =" << endl << "{";
+	for (size_t i = 0; i < image.size(); i++)
+	{
+		if (i % 16 == 0) headerFile << endl << "\t";
+		headerFile << (int)(unsigned char)image[i] << ",";
+	}
+	headerFile << endl << "};" << endl;
+	headerFile.close();
+
+	if (!headerFile)
+	{
+		cerr << "ERROR: Could not write config header: " << filename << endl;
+		errorStatus = 2;
+		end(errorStatus);
+	}
+}
+
+void unmapConfigBundle()
+{
+	if (configBundleData == NULL) return;
+
+#ifdef __WINDOWS_MM__
+	delete[] configBundleData;
+#else
+	munmap(configBundleData, configBundleSize);
+#endif
+
+	configBundleData = NULL;
+	configBundleSize = 0;
+}
+
+bool mapConfigBundle(const string& filename)
+{
+#ifdef __WINDOWS_MM__
+	ifstream bundleFile(filename.c_str(), ios::binary | ios::ate);
+	if (!bundleFile.good()) return false;
+
+	configBundleSize = bundleFile.tellg();
+	configBundleData = new char[configBundleSize];
+	bundleFile.seekg(0);
+	bundleFile.read(configBundleData, configBundleSize);
+	return bundleFile.good();
+#else
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0) return false;
+
+	struct stat fileInfo;
+	if (fstat(fd, &fileInfo) != 0 || fileInfo.st_size <= 0)
+	{
+		close(fd);
+		return false;
+	}
+
+	// private mapping: the file is never written, but priority changes can still reorder scales in memory
+	void* data = mmap(NULL, fileInfo.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (data == MAP_FAILED) return false;
+
+	configBundleData = (char*)data;
+	configBundleSize = fileInfo.st_size;
+	return true;
+#endif
+}
+
+void addBundleNames(const ConfigBundleName* entries, uint32_t numEntries, const char* characters, map<string, NoteSet>* forwardMap, map<NoteSet, string>* reverseMap)
+{
+	for (uint32_t i = 0; i < numEntries; i++)
+	{
+		string name(characters + entries[i].nameOffset, entries[i].nameLength);
+		NoteSet notes(entries[i].lowBits, entries[i].highBits);
+
+		forwardMap->insert(pair<string, NoteSet>(name, notes));
+		reverseMap->insert(pair<NoteSet, string>(notes, name));
+	}
+}
+
+// Points the dictionaries and chord-scale table at a validated bundle image
+void useConfigBundle(const char* data, bool includeChordScaleTable = true)
+{
+	const ConfigBundleHeader* header = (const ConfigBundleHeader*)data;
+	const char* payload = data + sizeof(ConfigBundleHeader);
+
+	const ConfigBundleName* chordNames = (const ConfigBundleName*)payload;
+	const ConfigBundleName* scaleNames = chordNames + header->numChordNames;
+	const ChordScaleSlot* slots = (const ChordScaleSlot*)(scaleNames + header->numScaleNames);
+	const uint16_t* scaleMasks = (const uint16_t*)(slots + NUM_NOTE_MASKS);
+	const char* nameCharacters = (const char*)(scaleMasks + header->numScaleMasks);
+
+	addBundleNames(chordNames, header->numChordNames, nameCharacters, &chordMap, &reverseChordMap);
+	addBundleNames(scaleNames, header->numScaleNames, nameCharacters, &scaleMap, &reverseScaleMap);
+
+	if (!includeChordScaleTable) return;
+
+	chordScaleTable = slots;
+	numChordScaleMasks = header->numScaleMasks;
+
+	// priority changes reorder scale masks in place, so they have to live in the private bundle mapping or a writable copy
+	if (data == configBundleData)
+	{
+		chordScaleMasks = (uint16_t*)scaleMasks;
+	}
+	else
+	{
+		chordScaleMaskStorage.assign(scaleMasks, scaleMasks + numChordScaleMasks);
+		chordScaleMasks = chordScaleMaskStorage.data();
+	}
+
+	rankChordScales();
+}
+
+// Loads the dictionaries and chord-scale table from a bundle compiled from the current config files
+// Returns false (leaving everything unloaded) if the bundle is missing, corrupt or stale
+bool loadConfigBundle(const string& filename, const string& mappingFilename)
+{
+	if (!mapConfigBundle(filename)) return false;
+
+	const ConfigBundleHeader* header = (const ConfigBundleHeader*)configBundleData;
+	const char* payload = configBundleData + sizeof(ConfigBundleHeader);
+
+	string reason = "";
+
+	if (configBundleSize < sizeof(ConfigBundleHeader) || memcmp(header->magic, CONFIG_BUNDLE_MAGIC, sizeof(header->magic)) != 0)
+		reason = "not a config bundle";
+	else if (header->version != CONFIG_BUNDLE_VERSION)
+		reason = "unsupported version";
+	else if (header->payloadSize != configBundleSize - sizeof(ConfigBundleHeader))
+		reason = "truncated";
+	else if (header->payloadSize != (header->numChordNames + header->numScaleNames) * sizeof(ConfigBundleName) + NUM_NOTE_MASKS * sizeof(ChordScaleSlot) + header->numScaleMasks * sizeof(uint16_t) + header->namesSize)
+		reason = "inconsistent section sizes";
+	else if (mappingFilename.compare(header->chordScaleMappingFilename) != 0)
+		reason = "compiled from a different chord-scale mapping";
+	else
+	{
+		ConfigSourceStamp stamps[NUM_CONFIG_SOURCES];
+		getSourceStamps(mappingFilename, stamps);
+
+		for (int i = 0; i < NUM_CONFIG_SOURCES; i++)
+		{
+			if (stamps[i].size != header->sources[i].size || stamps[i].modifiedTime != header->sources[i].modifiedTime)
+				reason = "config files have changed";
+		}
+
+		if (reason.size() == 0 && getChecksum(payload, header->payloadSize) != header->checksum)
+			reason = "checksum mismatch";
+	}
+
+	if (reason.size() > 0)
+	{
+		if (debugMode) cerr << "WARNING - loadConfigBundle('" << filename << "'): " << reason << ". Loading config files instead." << endl;
+		unmapConfigBundle();
+		return false;
+	}
+
+	useConfigBundle(configBundleData);
+
+	if (debugMode) cout << "Loaded config bundle '" << filename << "'." << endl;
+
+	return true;
+}
+
+#ifdef EMBEDDED_CONFIG
+#include "config/embedded_config.h"
+
+// Loads the dictionaries and, unless a mapping file overrides it, the chord-scale table compiled into the program
+void loadEmbeddedConfig(bool includeChordScaleTable)
+{
+	useConfigBundle((const char*)EMBEDDED_CONFIG_BUNDLE, includeChordScaleTable);
+
+	if (debugMode) cout << "Loaded embedded config." << endl;
+}
+#endif
+
+NoteSet normalizeBrightness(NoteSet chord)
+{
+	uint16_t dimNotes = chord.lowBits & ~chord.highBits;
+	uint16_t brightNotes = chord.highBits & ~chord.lowBits;
+	
+	bool shouldNormalize = dimNotes != 0 && brightNotes == 0;
+	
+	if (shouldNormalize)
+	{
+		return NoteSet(0, dimNotes);
+	}
+	
+	else
+	{
+		return chord;
+	}
+	
+}
+
+// Adds the brightness of each note, saturating at 3
+NoteSet combineChords(NoteSet chord1, NoteSet chord2)
+{
+	uint16_t carry = chord1.lowBits & chord2.lowBits;
+	uint16_t overflow = (chord1.highBits & chord2.highBits) | (carry & (chord1.highBits ^ chord2.highBits));
+	uint16_t low = (chord1.lowBits ^ chord2.lowBits) | overflow;
+	uint16_t high = (chord1.highBits ^ chord2.highBits ^ carry) | overflow;
+	
+	NoteSet combinedChord(low, high);
+	
+	if (brightMode)
+		combinedChord = normalizeBrightness(combinedChord);
+	
+	return combinedChord;
+}
+
+int getNoteIndex(string note)
+{
+	if (note.compare("C") == 0)
+	{
+		return 0;
+	}	
+	else if (note.compare("C#") == 0 || note.compare("Db") == 0)
+	{
+		return 1;
+	}	
+	else if (note.compare("D") == 0)
+	{
+		return 2;
+	}	
+	else if (note.compare("D#") == 0 || note.compare("Eb") == 0)
+	{
+		return 3;
+	}
+	else if (note.compare("E") == 0)
+	{
+		return 4;
+	}
+	else if (note.compare("F") == 0)
+	{
+		return 5;
+	}
+	else if (note.compare("F#") == 0 || note.compare("Gb") == 0)
+	{
+		return 6;
+	}
+	else if (note.compare("G") == 0)
+	{
+		return 7;
+	}
+	else if (note.compare("G#") == 0 || note.compare("Ab") == 0)
+	{
+		return 8;
+	}
+	else if (note.compare("A") == 0)
+	{
+		return 9;
+	}
+	else if (note.compare("A#") == 0 || note.compare("Bb") == 0)
+	{
+		return 10;
+	}
+	else if (note.compare("B") == 0)
+	{
+		return 11;
+	}
+	else
+	{
+		if (debugMode)
+		{
+			stringstream ss;
+			ss << "WARNING - getNoteIndex(): Unrecoginized note: '" << note << "'";
+			cout << ss.str() << endl;
+		}
+		return -1;
+	}
+}
+
+// Same results as getNoteIndex(getNoteName(noteName)) without building strings
+int getNoteIndex(uint8_t noteName)
+{
+	static const int8_t NOTE_NAME_INDICES[] =
+	{
+		-1,
+		9, 10, 8, // A A# Ab
+		11, -1, 10, // B B# Bb
+		0, 1, -1, // C C# Cb
+		2, 3, 1, // D D# Db
+		4, -1, 3, // E E# Eb
+		5, 6, -1, // F F# Fb
+		7, 8, 6 // G G# Gb
+	};
+
+	if (NOTE_NAME_INDICES[noteName] < 0) return getNoteIndex(getNoteName(noteName)); // reports the unrecognized note
+
+	return NOTE_NAME_INDICES[noteName];
+}
+
+bool findChordNotes(const string& chordType, NoteSet& notes)
+{
+	notes = NoteSet();
+
+	if (parseNoteString(chordType, notes)) return true;
+
+	map<string, NoteSet>::const_iterator it = chordMap.find(chordType);
+	if (it != chordMap.end())
+	{
+		notes = it->second;
+		return true;
+	}
+
+	it = scaleMap.find(chordType);
+	if (it != scaleMap.end())
+	{
+		notes = it->second;
+		return true;
+	}
+
+	return false;
+}
+
+NoteSet transposeScale(NoteSet scale, uint8_t fromRoot, uint8_t toRoot, int& errorStatus)
+{
+	if (scale.empty()) 
+		return scale;
+	
+	int fromRootIndex = getNoteIndex(fromRoot);
+	int toRootIndex = getNoteIndex(toRoot);
+
+	if (fromRootIndex >= 0 && toRootIndex >= 0)
+	{
+		// shift chord based on specified roots
+
+		int offset = toRootIndex - fromRootIndex;
+		if (offset < 0)	offset += NOTES_PER_OCTAVE;
+
+		scale = shiftNotesRight(scale, offset);
+	}
+	else
+	{
+		cerr << "ERROR - transposeScale(): One or both root notes unrecognized: " << endl;
+		cerr << "fromRoot: " << getNoteName(fromRoot) << endl;
+		cerr << "toRoot: " << getNoteName(toRoot) << endl;
+		cerr << "scale: " << getNoteString(scale) << endl;
+		cerr << "No transposition will be done." << endl;
+		errorStatus = 3;
+	}
+	
+	return scale;
+}
+
+NoteSet addBassNoteToScale(NoteSet scale, uint8_t bassNote)
+{
+	int bassIndex = getNoteIndex(bassNote);
+
+	if (bassIndex >= 0)
+	{
+		// add bass note if not present in chord
+		if (scale.brightness(bassIndex) == 0) scale.setBrightness(bassIndex, 1);
+	}
+	else
+	{
+		if (debugMode)
+		{
+			cerr << "WARNING - addBassNoteToScale(): Bass note unrecognized: " << endl;
+			cerr << "bassNote: " << getNoteName(bassNote) << endl;
+			cerr << "scale: " << getNoteString(scale) << endl;
+			cerr << "No modification will be done." << endl;
+		}
+	}
+
+	return scale;
+}
+
+NoteSet generateScale(Song& song, const ChordSymbol& symbol, const vector<NoteSet>& chordTypeNotes, const vector<bool>& chordTypeFound)
+{
+	if (!chordTypeFound[symbol.type])
+	{
+		cerr << "Unrecognized chord type: " << song.chordTypes[symbol.type] << endl;
+		song.unrecognizedChordTypes = true;
+	}
+
+	NoteSet scale = transposeScale(chordTypeNotes[symbol.type], parseNoteName(TextView("C", 1)), symbol.root, song.errorStatus);
+	scale = addBassNoteToScale(scale, symbol.bass);
+	return scale;
+}
+
+bool generateNoteProgression(Song& song) 
+{
+	song.noteProgression.reserve(song.progression.size());
+
+	// look up each distinct chord type once
+	vector<NoteSet> chordTypeNotes(song.chordTypes.size());
+	vector<bool> chordTypeFound(song.chordTypes.size());
+	for (int i = 0; i < song.chordTypes.size(); i++)
+	{
+		chordTypeFound[i] = findChordNotes(song.chordTypes[i], chordTypeNotes[i]);
+	}
+
+	for (int i = 0; i < song.progression.size(); i++)
+	{
+		NoteSet notesInChord = generateScale(song, song.progression[i].chord, chordTypeNotes, chordTypeFound);
+		NoteSet notesInScale = generateScale(song, song.progression[i].scale, chordTypeNotes, chordTypeFound);
+		
+		if (ignoreScales)
+			notesInScale = NoteSet();
+
+		song.noteProgression.push_back(combineChords(notesInChord, notesInScale));
+	}
+
+	if (song.unrecognizedChordTypes) 
+	{
+		cerr << endl << "ERROR: MIDI file could not be generated. Please update the chord list to include the missing chord types for this song." << endl;
+		song.errorStatus = 1;
+		return false;
+	}
+
+	return true;
+}
+
+// A run of consecutive segments showing the same notes (and bass note, when it is indicated)
+struct ChordRun
+{
+	int firstSegment;
+	int endSegment; // one past the last segment
+	int bassNoteIndex; // only looked up when the bass is indicated
+};
+
+// Splits the run's notes between the channels for the change to the next chord
+void separateNotesOfChordChange(Song& song, const ChordRun& run, NoteSet secondChord, bool oddToEven)
+{
+		NoteSet firstChord = song.noteProgression[run.firstSegment];
+		
+		NoteSet notesByChannel[NUM_CHANNELS];
+		
+		uint16_t sharedNotes = firstChord.mask() & secondChord.mask(); // chord change shares these notes
+		uint16_t privateNotes = firstChord.mask() & ~secondChord.mask(); // these notes are only in first chord
+		
+		notesByChannel[MIXED_CHORD_CHANNEL] = filterNotes(firstChord, sharedNotes);
+		
+		if (oddToEven)
+		{
+			notesByChannel[ODD_CHORD_CHANNEL] = filterNotes(firstChord, privateNotes);
+		}
+		else // even to odd
+		{
+			notesByChannel[EVEN_CHORD_CHANNEL] = filterNotes(firstChord, privateNotes);
+		}
+		
+		if (indicateBass)
+		{
+			notesByChannel[BASS_NOTE_CHANNEL].setBrightness(run.bassNoteIndex, firstChord.brightness(run.bassNoteIndex));
+			notesByChannel[ODD_CHORD_CHANNEL].setBrightness(run.bassNoteIndex, 0);
+			notesByChannel[EVEN_CHORD_CHANNEL].setBrightness(run.bassNoteIndex, 0);
+			notesByChannel[MIXED_CHORD_CHANNEL].setBrightness(run.bassNoteIndex, 0);
+		}
+		
+		// fill in all segments of the first chord
+		for (int segment = run.firstSegment; segment < run.endSegment; segment++)
+		{
+			for (int channel = 0; channel < NUM_CHANNELS; channel++)
+			{
+				song.noteProgressionByChannel[channel][segment] = notesByChannel[channel];
+			}
+		}
+}
+
+// Puts all notes of a run on one chord channel, without a transition
+void fillChordRun(Song& song, const ChordRun& run, int chordChannel)
+{
+	NoteSet notes = song.noteProgression[run.firstSegment];
+
+	NoteSet notesByChannel[NUM_CHANNELS];
+	notesByChannel[chordChannel] = notes;
+
+	if (indicateBass)
+	{
+		notesByChannel[BASS_NOTE_CHANNEL].setBrightness(run.bassNoteIndex, notes.brightness(run.bassNoteIndex));
+		notesByChannel[chordChannel].setBrightness(run.bassNoteIndex, 0);
+	}
+
+	for (int segment = run.firstSegment; segment < run.endSegment; segment++)
+	{
+		for (int channel = 0; channel < NUM_CHANNELS; channel++)
+		{
+			song.noteProgressionByChannel[channel][segment] = notesByChannel[channel];
+		}
+	}
+}
+
+void separateNoteProgressionByChannel(Song& song)
+{
+	// Compare each chord to the chord that comes next
+	// Move shared notes to channel 3
+	// Move private notes to channel 1/2 (alternating each chord change)
+	// eg. CM7_'ionian to Cm7_'aeolian
+	// 201021020102 -> [000020000102] [] [201001020000]
+	
+	int numSegments = song.noteProgression.size();
+
+	// initialize song.noteProgressionByChannel
+	for (int channel = 0; channel < NUM_CHANNELS; channel++)
+	{
+		song.noteProgressionByChannel[channel].assign(numSegments, NoteSet());
+	}
+
+	// group the segments into chords, a chord changes wherever the notes (or the indicated bass note) do
+	vector<ChordRun> runs;
+
+	for (int segment = 0; segment < numSegments; segment++)
+	{
+		uint8_t bass = song.progression[segment].chord.bass;
+
+		if (runs.empty() || song.noteProgression[segment] != song.noteProgression[segment-1] || (indicateBass && bass != song.progression[segment-1].chord.bass))
+		{
+			ChordRun run;
+			run.firstSegment = segment;
+			run.bassNoteIndex = indicateBass ? getNoteIndex(bass) : 0;
+			runs.push_back(run);
+		}
+
+		runs.back().endSegment = segment + 1;
+	}
+
+	if (runs.size() == 1) // there are no chord changes
+	{
+		fillChordRun(song, runs[0], ODD_CHORD_CHANNEL);
+		return;
+	}
+
+	bool isOddToEvenChordChange = true; // keep track of odd/even parity for each chord change
+
+	for (int r = 0; r + 1 < runs.size(); r++)
+	{
+		song.chordChanges.push_back(runs[r+1].firstSegment);
+		separateNotesOfChordChange(song, runs[r], song.noteProgression[runs[r+1].firstSegment], isOddToEvenChordChange);
+		toggle(isOddToEvenChordChange);
+	}
+
+	const ChordRun& lastRun = runs.back();
+
+	if (loopMode)
+	{
+		// transition back to the first chord, or past it when the last chord already continues into it
+		const ChordRun* nextRun = &runs[0];
+
+		if (song.noteProgression[0] == song.noteProgression[lastRun.firstSegment])
+			nextRun = &runs[1];
+		else
+			song.chordChanges.push_back(0); // indicate a chord change to first chord
+
+		separateNotesOfChordChange(song, lastRun, song.noteProgression[nextRun->firstSegment], isOddToEvenChordChange);
+	}
+	else // use same color
+	{
+		fillChordRun(song, lastRun, isOddToEvenChordChange ? ODD_CHORD_CHANNEL : EVEN_CHORD_CHANNEL);
+	}
+}
+
+// Fills the note message table from the pitch range of each channel
+void buildNoteMessageTable()
+{
+	for (int channel = 0; channel < NUM_OUTPUT_CHANNELS; channel++)
+	{
+		int lowestPitch = max(channelPitchRanges[channel].lowest, 0);
+		int highestPitch = min(channelPitchRanges[channel].highest, 127);
+
+		for (int noteIndex = 0; noteIndex < NOTES_PER_OCTAVE; noteIndex++)
+		{
+			for (int noteBrightness = 0; noteBrightness < NUM_BRIGHTNESS_LEVELS; noteBrightness++)
+			{
+				unsigned char statusByte = 0x90; // note on message
+				if (noteBrightness == 0) // note off message
+					statusByte = 0x80;
+				statusByte += channel + STARTING_CHANNEL;
+
+				unsigned char velocityByte = 0x00;
+				if (noteBrightness == 1)
+					velocityByte = dimNoteVelocity;
+				else if (noteBrightness == 2)
+					velocityByte = brightNoteVelocity;
+
+				NoteMessageRun& run = noteMessageTable[channel][noteIndex][noteBrightness];
+				run.numMessages = 0;
+
+				// lowest pitch of this pitch class in range, then every octave above it
+				int pitch = lowestPitch + (noteIndex - lowestPitch % NOTES_PER_OCTAVE + NOTES_PER_OCTAVE) % NOTES_PER_OCTAVE;
+
+				for (; pitch <= highestPitch; pitch += NOTES_PER_OCTAVE)
+				{
+					unsigned char* noteMessage = run.bytes + run.numMessages * NOTE_MESSAGE_SIZE;
+					noteMessage[0] = statusByte;
+					noteMessage[1] = pitch;
+					noteMessage[2] = velocityByte;
+					run.numMessages++;
+				}
+
+				if (debugMode)
+				{
+					cout << "Channel: " << channel << " | Note Index: " << noteIndex << " | Note Brightness: " << noteBrightness << " | Messages: ";
+					for (int i = 0; i < run.numMessages * NOTE_MESSAGE_SIZE; i++)
+					{
+						cout << "0x" << hex << uppercase << (int)run.bytes[i] << dec << nouppercase << " ";
+					}
+					cout << endl;
+				}
+			}
+		}
+	}
+
+	if (debugMode) cout << endl;
+}
+
+void sendOutputMessage(const unsigned char* message, size_t size)
+{
+	if (outputSink)
+		outputSink(message, size);
+	else
+		midiOut->sendMessage(message, size);
+}
+
+// Sends note on or off messages for the specified note on all octaves of the specified channel
+void sendNoteMessages(int channel, int noteIndex, int noteBrightness)
+{
+	const NoteMessageRun& run = noteMessageTable[channel][noteIndex][noteBrightness];
+
+	for (int i = 0; i < run.numMessages; i++)
+	{
+		sendOutputMessage(run.bytes + i * NOTE_MESSAGE_SIZE, NOTE_MESSAGE_SIZE);
+	}
+}
+
+int getUpdateChannel()
+{
+	return indicateBass ? BASS_NOTE_CHANNEL : EVEN_CHORD_CHANNEL;
+}
+
+void sendUpdateMessage()
+{
+	unsigned char updateMessage[] = { (unsigned char)(0xB0 + getUpdateChannel() + STARTING_CHANNEL), UPDATE_ALL_MESSAGE_CODE, 0x7F }; // control change, max on signal
+
+	sendOutputMessage(updateMessage, sizeof(updateMessage));
+}
+
+// Compact frame protocol (--frames): all 12 pitch classes of a channel in one SysEx message
+// F0 7D <channel> <4 data bytes, 3 pitch classes of 2 brightness bits each, lowest first> F7
+const int FRAME_MESSAGE_SIZE = 9;
+const unsigned char FRAME_MANUFACTURER_ID = 0x7D; // non-commercial
+const int PITCH_CLASSES_PER_FRAME_BYTE = 3;
+
+void encodeFrameMessage(int channel, const uint8_t* brightness, unsigned char* frameMessage)
+{
+	frameMessage[0] = 0xF0;
+	frameMessage[1] = FRAME_MANUFACTURER_ID;
+	frameMessage[2] = channel + STARTING_CHANNEL;
+
+	for (int i = 0; i < NOTES_PER_OCTAVE / PITCH_CLASSES_PER_FRAME_BYTE; i++)
+	{
+		unsigned char dataByte = 0;
+		for (int j = 0; j < PITCH_CLASSES_PER_FRAME_BYTE; j++)
+		{
+			dataByte |= (brightness[i * PITCH_CLASSES_PER_FRAME_BYTE + j] & 3) << (2 * j);
+		}
+		frameMessage[3 + i] = dataByte;
+	}
+
+	frameMessage[FRAME_MESSAGE_SIZE - 1] = 0xF7;
+}
+
+// Reference decoder for the LED side of the protocol
+bool decodeFrameMessage(const unsigned char* frameMessage, int& channel, uint8_t* brightness)
+{
+	if (frameMessage[0] != 0xF0 || frameMessage[1] != FRAME_MANUFACTURER_ID || frameMessage[FRAME_MESSAGE_SIZE - 1] != 0xF7)
+		return false;
+
+	channel = frameMessage[2] - STARTING_CHANNEL;
+
+	for (int noteIndex = 0; noteIndex < NOTES_PER_OCTAVE; noteIndex++)
+	{
+		unsigned char dataByte = frameMessage[3 + noteIndex / PITCH_CLASSES_PER_FRAME_BYTE];
+		brightness[noteIndex] = (dataByte >> (2 * (noteIndex % PITCH_CLASSES_PER_FRAME_BYTE))) & 3;
+	}
+
+	return true;
+}
+
+int getVelocityBrightness(int velocity)
+{
+	if (velocity == 0) return 0;
+	return velocity == brightNoteVelocity ? 2 : 1;
+}
+
+// Sends the whole frame of a channel as one message
+void sendFrameMessage(int channel, NoteSet frame)
+{
+	uint8_t brightness[NOTES_PER_OCTAVE];
+	for (int noteIndex = 0; noteIndex < NOTES_PER_OCTAVE; noteIndex++)
+	{
+		brightness[noteIndex] = frame.brightness(noteIndex);
+	}
+
+	unsigned char frameMessage[FRAME_MESSAGE_SIZE];
+	encodeFrameMessage(channel, brightness, frameMessage);
+
+	sendOutputMessage(frameMessage, FRAME_MESSAGE_SIZE);
+}
+
+// Live playback (--play): the events of the output file sent to midiOut on time instead of written
+struct PlaybackEvent
+{
+	int64_t tick;
+	int size;
+	unsigned char bytes[FRAME_MESSAGE_SIZE];
+};
+
+const int64_t PLAYBACK_SPIN_NANOSECONDS = 200000; // sleep until this close to a deadline, then spin
+
+vector<PlaybackEvent> playbackEvents; // the whole song in send order
+atomic<uint64_t> playbackLoops(0); // completed passes through the song
+
+// Events sharing a tick are written in the order MidiFile::sortTracks put them: meta messages, other messages, note offs, note ons
+enum TrackEventPriority { META_EVENT, CONTROL_EVENT, NOTE_OFF_EVENT, NOTE_ON_EVENT };
+
+const int MAX_TRACK_EVENT_SIZE = 6; // set tempo meta message
+
+struct TrackEvent
+{
+	int64_t tick;
+	TrackEventPriority priority;
+	uint64_t sequence; // events with the same tick and priority keep the order they were queued in
+	unsigned char bytes[MAX_TRACK_EVENT_SIZE];
+	int size;
+
+	bool operator>(const TrackEvent& other) const
+	{
+		if (tick != other.tick) return tick > other.tick;
+		if (priority != other.priority) return priority > other.priority;
+		return sequence > other.sequence;
+	}
+};
+
+const int NUM_MIDI_PITCHES = 128;
+const int UNKNOWN_VELOCITY = -1;
+
+// Writes one track of the output file as its events are queued, holding back only those a later event could still precede
+struct TrackWriter
+{
+	int track;
+	ostream* out; // NULL while only measuring the length of the track
+	uint64_t length;
+	int64_t lastTick;
+	uint64_t numQueuedEvents;
+	priority_queue<TrackEvent, vector<TrackEvent>, greater<TrackEvent> > pendingEvents;
+	MidiFile* debugFile; // also receives the written events, for the binasc dump
+	vector<PlaybackEvent>* playbackEvents; // also receives the written events, for live playback
+
+	// LED state of the channel, events that would not change it are left out
+	vector<TrackEvent> tickEvents; // events of the tick being written
+	int pitchVelocities[NUM_MIDI_PITCHES]; // 0 when off, unknown until the first message since the player may loop
+	int lastEventOfPitch[NUM_MIDI_PITCHES]; // index into tickEvents
+	int numRedundantEvents;
+
+	unsigned char runningStatusByte; // 0 while no running status is in effect
+	uint64_t numRunningStatusBytes;
+
+	bool frames; // notes go out as compact frames (--frames)
+	uint8_t frameBrightness[NOTES_PER_OCTAVE]; // what the channel shows, for compact frames
+};
+
+void writeTrackBytes(TrackWriter& writer, const unsigned char* bytes, int size)
+{
+	writer.length += size;
+	if (writer.out) writer.out->write((const char*)bytes, size);
+}
+
+void writeVariableLengthValue(TrackWriter& writer, uint32_t value)
+{
+	unsigned char bytes[5];
+	int size = 0;
+
+	// 7 bits per byte, most significant first, all but the last byte flagged
+	bytes[size++] = value & 0x7F;
+	while (value >>= 7)
+		bytes[size++] = 0x80 | (value & 0x7F);
+
+	reverse(bytes, bytes + size);
+	writeTrackBytes(writer, bytes, size);
+}
+
+void queueTrackEvent(TrackWriter& writer, int track, int64_t tick, TrackEventPriority priority, const unsigned char* bytes, int size)
+{
+	if (track != writer.track) return;
+
+	TrackEvent event;
+	event.tick = max(tick, (int64_t)0); // nudged events can not start before the song
+	event.priority = priority;
+	event.sequence = writer.numQueuedEvents++;
+	memcpy(event.bytes, bytes, size);
+	event.size = size;
+
+	writer.pendingEvents.push(event);
+}
+
+bool isNoteEvent(const TrackEvent& event)
+{
+	return event.priority == NOTE_OFF_EVENT || event.priority == NOTE_ON_EVENT;
+}
+
+void recordWrittenEvent(TrackWriter& writer, int64_t tick, const unsigned char* bytes, int size)
+{
+	if (writer.debugFile)
+	{
+		vector<unsigned char> message(bytes, bytes + size);
+		writer.debugFile->addEvent(writer.track, tick, message);
+	}
+
+	if (writer.playbackEvents && bytes[0] != 0xFF) // meta events are not sent
+	{
+		PlaybackEvent event;
+		event.tick = tick;
+		event.size = size;
+		memcpy(event.bytes, bytes, size);
+		writer.playbackEvents->push_back(event);
+	}
+}
+
+// Writes the channel's frame as a sysex event: F0, the length of the rest, the rest up to and including F7
+void writeFrameEvent(TrackWriter& writer, int64_t tick)
+{
+	unsigned char frameMessage[FRAME_MESSAGE_SIZE];
+	encodeFrameMessage(writer.track, writer.frameBrightness, frameMessage);
+
+	writeVariableLengthValue(writer, tick - writer.lastTick);
+	writeTrackBytes(writer, frameMessage, 1);
+	writeVariableLengthValue(writer, FRAME_MESSAGE_SIZE - 1);
+	writeTrackBytes(writer, frameMessage + 1, FRAME_MESSAGE_SIZE - 1);
+	writer.lastTick = tick;
+	writer.runningStatusByte = 0; // sysex events cancel running status
+
+	recordWrittenEvent(writer, tick, frameMessage, FRAME_MESSAGE_SIZE);
+}
+
+// Writes the events of one tick, leaving out notes that end up showing what they already showed and repeated updates
+void writeTickEvents(TrackWriter& writer)
+{
+	vector<TrackEvent>& events = writer.tickEvents;
+
+	// only the last message for a pitch within a tick decides what it shows
+	for (int i = 0; i < events.size(); i++)
+	{
+		if (isNoteEvent(events[i])) writer.lastEventOfPitch[events[i].bytes[1]] = i;
+	}
+
+	int controlEvent = -1;
+	bool frameChanged = false;
+
+	for (int i = 0; i < events.size(); i++)
+	{
+		const TrackEvent& event = events[i];
+		bool redundant = false;
+
+		if (isNoteEvent(event))
+		{
+			int pitch = event.bytes[1];
+			int velocity = event.priority == NOTE_ON_EVENT ? event.bytes[2] : 0;
+
+			if (writer.lastEventOfPitch[pitch] != i || writer.pitchVelocities[pitch] == velocity)
+				redundant = true;
+			else
+				writer.pitchVelocities[pitch] = velocity;
+
+			// notes go out as one frame after the rest of the tick
+			if (writer.frames && !redundant)
+			{
+				writer.frameBrightness[pitch % NOTES_PER_OCTAVE] = getVelocityBrightness(velocity);
+				frameChanged = true;
+				continue;
+			}
+		}
+		else if (event.priority == CONTROL_EVENT)
+		{
+			// one update per tick refreshes everything
+			if (controlEvent >= 0 && memcmp(events[controlEvent].bytes, event.bytes, event.size) == 0)
+				redundant = true;
+			else
+				controlEvent = i;
+		}
+
+		if (redundant)
+		{
+			writer.numRedundantEvents++;
+			continue;
+		}
+
+		unsigned char bytes[MAX_TRACK_EVENT_SIZE];
+		memcpy(bytes, event.bytes, event.size);
+		int statusSize = 1;
+
+		if (runningStatus)
+		{
+			// a note on without velocity turns the note off and keeps the channel's note on status running
+			if (event.priority == NOTE_OFF_EVENT)
+				bytes[0] = 0x90 | (bytes[0] & 0x0F);
+
+			if (bytes[0] == 0xFF) // meta events cancel running status
+			{
+				writer.runningStatusByte = 0;
+			}
+			else if (bytes[0] == writer.runningStatusByte)
+			{
+				statusSize = 0;
+				writer.numRunningStatusBytes++;
+			}
+			else
+			{
+				writer.runningStatusByte = bytes[0];
+			}
+		}
+
+		writeVariableLengthValue(writer, event.tick - writer.lastTick);
+		writeTrackBytes(writer, bytes + 1 - statusSize, event.size - 1 + statusSize);
+		writer.lastTick = event.tick;
+
+		recordWrittenEvent(writer, event.tick, event.bytes, event.size); // as queued, so the read back check sees running status undone
+	}
+
+	if (frameChanged) writeFrameEvent(writer, events[0].tick);
+
+	events.clear();
+}
+
+// Writes the queued events before the specified tick, no event queued afterwards may come earlier
+void flushTrackEvents(TrackWriter& writer, int64_t beforeTick)
+{
+	while (!writer.pendingEvents.empty() && writer.pendingEvents.top().tick < beforeTick)
+	{
+		int64_t tick = writer.pendingEvents.top().tick;
+
+		while (!writer.pendingEvents.empty() && writer.pendingEvents.top().tick == tick)
+		{
+			writer.tickEvents.push_back(writer.pendingEvents.top());
+			writer.pendingEvents.pop();
+		}
+
+		writeTickEvents(writer);
+	}
+}
+
+// Queues a set_tempo meta message with the specified BPM
+void queueTempoMessage(TrackWriter& writer, int bpm)
+{
+	uint32_t microsecondsPerQuarterNote = (uint32_t)(60000000.0 / bpm + 0.5); // rounded like MidiFile::addTempo
+
+	unsigned char setTempoMessage[] = { 0xFF, 0x51, 0x03, (unsigned char)(microsecondsPerQuarterNote >> 16), (unsigned char)(microsecondsPerQuarterNote >> 8), (unsigned char)microsecondsPerQuarterNote };
+
+	queueTrackEvent(writer, writer.track, 0, META_EVENT, setTempoMessage, sizeof(setTempoMessage));
+}
+
+// Queues note on or off messages for the specified note on all octaves of the specified channel
+void queueNoteMessages(TrackWriter& writer, int channel, int noteIndex, int noteBrightness, int64_t ticks)
+{
+	if (channel != writer.track) return;
+
+	const NoteMessageRun& run = noteMessageTable[channel][noteIndex][noteBrightness];
+	TrackEventPriority priority = noteBrightness > 0 ? NOTE_ON_EVENT : NOTE_OFF_EVENT;
+
+	for (int i = 0; i < run.numMessages; i++)
+	{
+		queueTrackEvent(writer, channel, ticks, priority, run.bytes + i * NOTE_MESSAGE_SIZE, NOTE_MESSAGE_SIZE);
+	}
+}
+
+void queueUpdateMessage(TrackWriter& writer, int64_t ticks)
+{
+	int channel = getUpdateChannel();
+	unsigned char updateMessage[] = { (unsigned char)(0xB0 + channel + STARTING_CHANNEL), UPDATE_ALL_MESSAGE_CODE, 0x7F }; // control change, max on signal
+
+	queueTrackEvent(writer, channel, ticks, CONTROL_EVENT, updateMessage, sizeof(updateMessage));
+}
+
+// Generates the events of the song in tick order, only those on the writer's track are kept
+void writeSongTrack(Song& song, TrackWriter& writer)
+{
+	// Add tempo midi event
+	// Add note ons and note offs for every octave based on chord changes to the appropriate channel
+	// Make sure to use blinking lead-in
+	
+	queueTempoMessage(writer, song.beatsPerMinute);
+
+	
+	// add first chord
+
+	for (int channel = 0; channel < NUM_CHANNELS; channel++)
+	{
+		if (channel == BASS_NOTE_CHANNEL && !indicateBass) continue;
+
+		for (int noteIndex = 0; noteIndex < NOTES_PER_OCTAVE; noteIndex++)
+		{
+			int noteBrightness = song.noteProgressionByChannel[channel][0].brightness(noteIndex);
+			if (noteBrightness > 0)
+			{
+				int tickOffset = 2;
+				queueNoteMessages(writer, channel, noteIndex, noteBrightness, 0+tickOffset);
+			}
+		}
+	}
+	int tickOffset = 8;
+	queueUpdateMessage(writer, 0 + tickOffset);
+
+	// the update for looping back to the first segment happens at its start, with the first chord
+	bool loopsToFirstSegment = song.chordChanges.size() > 0 && song.chordChanges.back() == 0;
+	if (loopsToFirstSegment)
+	{
+		tickOffset = 2;
+		queueUpdateMessage(writer, 0 + tickOffset);
+	}
+		
+	
+	// add all chord changes
+
+	int lastSegment = song.progression.size() - 1;
+
+	for (int chordChange = 0; chordChange < song.chordChanges.size(); chordChange++)
+	{
+		int segmentOfChordChange = song.chordChanges[chordChange];
+		int64_t tickOfChordChange = song.progression[segmentOfChordChange].startTick;
+		
+		int segmentOfChangingChord = segmentOfChordChange - 1;
+		if (segmentOfChangingChord < 0) segmentOfChangingChord = lastSegment; // last segment in song
+
+		// the lead-in blinks during the last beat before the change, or all of the changing segment if it is shorter
+		int64_t leadInLength = min((int64_t)TICKS_PER_QUARTER_NOTE, song.progression[segmentOfChangingChord].duration);
+		int64_t tickOfLeadIn = (segmentOfChordChange == 0 ? song.numTicks : tickOfChordChange) - leadInLength;
+		int64_t tickOfLeadInOffBeat = tickOfLeadIn + leadInLength/2;
+
+		// the lead-in starts after the previous chord change, so nothing from here on comes before it
+		flushTrackEvents(writer, tickOfLeadIn - 2);
+
+		if (segmentOfChordChange != 0) // add all chord change notes except for chord change to the first segment (first chord already added)
+		{
+			for (int channel = 0; channel < NUM_CHANNELS; channel++)
+			{
+				if (channel == BASS_NOTE_CHANNEL && !indicateBass) continue;
+
+				// add chord notes
+				for (int noteIndex = 0; noteIndex < NOTES_PER_OCTAVE; noteIndex++)
+				{
+					int noteBrightness = song.noteProgressionByChannel[channel][segmentOfChordChange].brightness(noteIndex);
+					tickOffset = -2;
+					
+					queueNoteMessages(writer, channel, noteIndex, noteBrightness, tickOfChordChange+tickOffset);
+				}
+			}
+		}
+
+		if (segmentOfChordChange != 0 || (segmentOfChordChange == 0 && loopMode))
+		{
+			// add chord lead-in before chord change
+			for (int noteIndex = 0; noteIndex < NOTES_PER_OCTAVE; noteIndex++)
+			{
+				int nextChordChannel;
+				if (chordChange % 2)
+				{
+					nextChordChannel = ODD_CHORD_CHANNEL;
+				}
+				else 
+				{
+					nextChordChannel = EVEN_CHORD_CHANNEL;
+				}
+				
+				if (song.noteProgression[segmentOfChordChange].brightness(noteIndex) > 0)
+				{
+					tickOffset = -2;
+					
+					int channel;
+
+					if (song.noteProgression[segmentOfChangingChord].brightness(noteIndex) == 0)
+					{ // chord change adds new note
+						channel = nextChordChannel;
+					}
+					else if (song.noteProgression[segmentOfChordChange].brightness(noteIndex) > song.noteProgression[segmentOfChangingChord].brightness(noteIndex))
+					{ // chord change increases brightness of currently active note
+						// current note is the current root/bass note
+						if (indicateBass && song.noteProgressionByChannel[BASS_NOTE_CHANNEL][segmentOfChangingChord].brightness(noteIndex) > 0)
+						{
+							channel =  BASS_NOTE_CHANNEL;
+						}
+						else
+						{
+							channel = MIXED_CHORD_CHANNEL;
+						}
+					}
+					else
+					{
+						continue;
+					}
+
+					// on beat
+					queueNoteMessages(writer, channel, noteIndex, song.noteProgression[segmentOfChordChange].brightness(noteIndex), tickOfLeadIn+tickOffset);
+					// off beat
+					queueNoteMessages(writer, channel, noteIndex, song.noteProgression[segmentOfChangingChord].brightness(noteIndex), tickOfLeadInOffBeat+tickOffset);
+				}
+			}
+		}
+	
+		// update after writing each chord
+		tickOffset = 2;
+		if (segmentOfChordChange != 0) queueUpdateMessage(writer, tickOfChordChange+tickOffset); // looping back was updated at the start
+		queueUpdateMessage(writer, tickOfLeadIn+tickOffset); // transistion on beat
+		queueUpdateMessage(writer, tickOfLeadInOffBeat+tickOffset); // transistion off beat
+		
+	}
+
+	
+	// clear all notes after last segment in song
+	
+	for (int channel = 0; channel < NUM_CHANNELS; channel++)
+	{
+		for (int noteIndex = 0; noteIndex < NOTES_PER_OCTAVE; noteIndex++)
+		{
+			int noteBrightness = song.noteProgressionByChannel[channel][lastSegment].brightness(noteIndex);
+			if (noteBrightness > 0)
+			{
+				tickOffset = -2;
+				queueNoteMessages(writer, channel, noteIndex, 0, song.numTicks+tickOffset);
+			}
+		}
+	}
+	
+	tickOffset = 0;
+	queueUpdateMessage(writer, song.numTicks+tickOffset);
+
+	flushTrackEvents(writer, INT64_MAX);
+
+	unsigned char endOfTrackMessage[] = { 0x00, 0xFF, 0x2F, 0x00 }; // at the last event
+	writeTrackBytes(writer, endOfTrackMessage, sizeof(endOfTrackMessage));
+}
+
+// Note offs written with running status are note ons with velocity 0, both are compared as note offs with velocity 0
+vector<unsigned char> getComparableMessage(const vector<unsigned char>& message)
+{
+	vector<unsigned char> comparable = message;
+	unsigned char command = message[0] & 0xF0;
+
+	if (message.size() == NOTE_MESSAGE_SIZE && (command == noteOffCodeMin || (command == noteOnCodeMin && message[2] == 0)))
+	{
+		comparable[0] = noteOffCodeMin | (message[0] & 0x0F);
+		comparable[2] = 0;
+	}
+
+	return comparable;
+}
+
+bool isEndOfTrackMessage(const vector<unsigned char>& message)
+{
+	return message.size() >= 2 && message[0] == 0xFF && message[1] == 0x2F;
+}
+
+// Checks that every track read back from the output file holds exactly the events that were written to it
+bool readsBackAsWritten(Song& song, MidiFile& writtenFile)
+{
+	writtenFile.absoluteTicks();
+
+	for (int track = 0; track < NUM_CHANNELS; track++)
+	{
+		int numWritten = song.midiOutputFile[track].size();
+		int numRead = writtenFile[track].size();
+		if (numRead > 0 && isEndOfTrackMessage(writtenFile[track][numRead-1])) numRead--; // written outside the event stream
+
+		for (int i = 0; i < max(numWritten, numRead); i++)
+		{
+			if (i < numWritten && i < numRead
+				&& song.midiOutputFile[track][i].tick == writtenFile[track][i].tick
+				&& getComparableMessage(song.midiOutputFile[track][i]) == getComparableMessage(writtenFile[track][i]))
+				continue;
+
+			cerr << "ERROR: Output file '" << song.outputFilename << "' reads back differently from what was written (track " << track << ", event " << i << ")" << endl;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void initializeTrackWriter(TrackWriter& writer, int track, ostream* out, MidiFile* debugFile, vector<PlaybackEvent>* playbackEvents)
+{
+	writer.track = track;
+	writer.out = out;
+	writer.length = 0;
+	writer.lastTick = 0;
+	writer.numQueuedEvents = 0;
+	writer.debugFile = debugFile;
+	writer.playbackEvents = playbackEvents;
+	fill(writer.pitchVelocities, writer.pitchVelocities + NUM_MIDI_PITCHES, UNKNOWN_VELOCITY);
+	writer.numRedundantEvents = 0;
+	writer.runningStatusByte = 0;
+	writer.numRunningStatusBytes = 0;
+	writer.frames = compactFrames;
+	fill(writer.frameBrightness, writer.frameBrightness + NOTES_PER_OCTAVE, 0);
+}
+
+// Writes (or only measures, without an output stream) the specified track and returns its length
+uint64_t writeTrack(Song& song, int track, ostream* out, MidiFile* debugFile = NULL, vector<PlaybackEvent>* playbackEvents = NULL)
+{
+	TrackWriter writer;
+	initializeTrackWriter(writer, track, out, debugFile, playbackEvents);
+
+	writeSongTrack(song, writer);
+
+	if (out || playbackEvents)
+	{
+		song.numRedundantEvents += writer.numRedundantEvents;
+		song.numRunningStatusBytes += writer.numRunningStatusBytes;
+	}
+
+	return writer.length;
+}
+
+void writeBigEndian(ostream& out, uint32_t value, int numBytes)
+{
+	for (int i = numBytes - 1; i >= 0; i--)
+	{
+		out.put((char)(value >> (8 * i)));
+	}
+}
+
+// Renders the track again with a note message per octave and checks with the reference decoder that the written frames show the same LEDs after every tick
+bool verifyFrameTrack(Song& song, int track)
+{
+	MidiFile noteFile;
+	noteFile.absoluteTicks();
+	noteFile.addTrack(NUM_CHANNELS-1); // 1 channel already present
+
+	TrackWriter writer;
+	initializeTrackWriter(writer, track, NULL, &noteFile, NULL);
+	writer.frames = false;
+	writeSongTrack(song, writer);
+
+	int lowestPitch = max(channelPitchRanges[track].lowest, 0);
+	int highestPitch = min(channelPitchRanges[track].highest, NUM_MIDI_PITCHES - 1);
+
+	int pitchVelocities[NUM_MIDI_PITCHES] = {}; // every LED starts off
+	uint8_t brightness[NOTES_PER_OCTAVE] = {};
+	int numNoteEvents = noteFile[track].size();
+	int numFrameEvents = song.midiOutputFile[track].size();
+	int noteIndex = 0;
+	int frameIndex = 0;
+
+	while (noteIndex < numNoteEvents || frameIndex < numFrameEvents)
+	{
+		int64_t tick = INT64_MAX;
+		if (noteIndex < numNoteEvents) tick = noteFile[track][noteIndex].tick;
+		if (frameIndex < numFrameEvents) tick = min(tick, (int64_t)song.midiOutputFile[track][frameIndex].tick);
+
+		for (; noteIndex < numNoteEvents && noteFile[track][noteIndex].tick == tick; noteIndex++)
+		{
+			const vector<unsigned char>& message = noteFile[track][noteIndex];
+			unsigned char command = message[0] & 0xF0;
+			if (command == noteOnCodeMin) pitchVelocities[message[1]] = message[2];
+			else if (command == noteOffCodeMin) pitchVelocities[message[1]] = 0;
+		}
+
+		for (; frameIndex < numFrameEvents && song.midiOutputFile[track][frameIndex].tick == tick; frameIndex++)
+		{
+			const vector<unsigned char>& message = song.midiOutputFile[track][frameIndex];
+			if (message[0] != 0xF0) continue;
+
+			int channel;
+			if (message.size() != FRAME_MESSAGE_SIZE || !decodeFrameMessage(&message[0], channel, brightness) || channel != track)
+			{
+				cerr << "ERROR: Frame of channel " << track << " at tick " << tick << " does not decode" << endl;
+				return false;
+			}
+		}
+
+		for (int pitch = lowestPitch; pitch <= highestPitch; pitch++)
+		{
+			if (getVelocityBrightness(pitchVelocities[pitch]) != brightness[pitch % NOTES_PER_OCTAVE])
+			{
+				cerr << "ERROR: Frames of channel " << track << " at tick " << tick << " do not match its note messages (pitch " << pitch << ")" << endl;
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+void createMidiFile(Song& song)
+{
+	// Every track is generated twice, once to learn its length for the chunk header and once to write it,
+	// so the file streams out without ever being held in memory
+	
+	ofstream outputFile;
+	ostream standardOutput(standardOutputBuffer);
+	ostream* out = &standardOutput;
+
+	if (song.outputFilename != STANDARD_OUTPUT_FILENAME)
+	{
+		remove(song.outputFilename.c_str()); // the old output may be a hardlink into the render cache, never write through it
+		outputFile.open(song.outputFilename.c_str(), ios::binary);
+		out = &outputFile;
+	}
+
+	if (!*out)
+	{
+		cerr << "ERROR: Could not write output file '" << song.outputFilename << "'" << endl;
+		song.errorStatus = 1;
+		return;
+	}
+
+	MidiFile* debugFile = NULL;
+
+	// midifile keeps ticks in an int, longer songs are written without the debug copy and its checks
+	bool debugChecks = debugMode && song.numTicks <= INT_MAX;
+	if (debugMode && !debugChecks) cerr << "WARNING - createMidiFile('" << song.outputFilename << "'): the song is too long for the debug checks. Skipping them." << endl;
+
+	if (debugChecks)
+	{
+		debugFile = &song.midiOutputFile;
+		debugFile->absoluteTicks();
+		debugFile->addTrack(NUM_CHANNELS-1); // 1 channel already present
+		debugFile->setTicksPerQuarterNote(TICKS_PER_QUARTER_NOTE);
+	}
+
+	// header chunk
+	out->write("MThd", 4);
+	writeBigEndian(*out, 6, 4);
+	writeBigEndian(*out, NUM_CHANNELS > 1 ? 1 : 0, 2); // format
+	writeBigEndian(*out, NUM_CHANNELS, 2); // one track per channel
+	writeBigEndian(*out, TICKS_PER_QUARTER_NOTE, 2);
+
+	song.outputFileSize = 14;
+
+	for (int track = 0; track < NUM_CHANNELS; track++)
+	{
+		uint64_t trackLength = writeTrack(song, track, NULL);
+
+		if (trackLength > UINT32_MAX)
+		{
+			cerr << "ERROR: Track " << track << " of output file '" << song.outputFilename << "' is longer than a MIDI track chunk can hold" << endl;
+			song.errorStatus = 1;
+			return;
+		}
+
+		out->write("MTrk", 4);
+		writeBigEndian(*out, trackLength, 4);
+		writeTrack(song, track, out, debugFile);
+
+		song.outputFileSize += 8 + trackLength;
+	}
+
+	out->flush();
+
+	if (!*out)
+	{
+		cerr << "ERROR: Could not write output file '" << song.outputFilename << "'" << endl;
+		song.errorStatus = 1;
+	}
+	
+	if (debugChecks)
+	{
+		// the output must read back, running status included
+		MidiFile writtenFile;
+		outputFile.close();
+
+		if (song.outputFilename != STANDARD_OUTPUT_FILENAME && (!writtenFile.read(song.outputFilename) || writtenFile.getTrackCount() != NUM_CHANNELS))
+		{
+			cerr << "ERROR: Output file '" << song.outputFilename << "' does not read back as a MIDI file" << endl;
+			song.errorStatus = 1;
+		}
+		else if (song.outputFilename != STANDARD_OUTPUT_FILENAME && !readsBackAsWritten(song, writtenFile))
+		{
+			song.errorStatus = 1;
+		}
+
+		for (int track = 0; compactFrames && track < NUM_CHANNELS; track++)
+		{
+			if (!verifyFrameTrack(song, track)) song.errorStatus = 1;
+		}
+
+		song.midiOutputFile.writeBinascWithComments(BINASC_DIRECTORY + song.outputFilename + ".binasc");
+	}
+}
+
+bool isControlEvent(const PlaybackEvent& event)
+{
+	return (event.bytes[0] & 0xF0) == ccStatusCodeMin;
+}
+
+// Merges the events of every track in send order, updates after the notes they show
+void collectPlaybackEvents(Song& song)
+{
+	playbackEvents.clear();
+
+	for (int track = 0; track < NUM_CHANNELS; track++)
+	{
+		writeTrack(song, track, NULL, NULL, &playbackEvents);
+	}
+
+	stable_sort(playbackEvents.begin(), playbackEvents.end(), [](const PlaybackEvent& a, const PlaybackEvent& b)
+	{
+		if (a.tick != b.tick) return a.tick < b.tick;
+		return !isControlEvent(a) && isControlEvent(b);
+	});
+}
+
+bool isNoteSounding(const ChannelNoteState& state, int note)
+{
+	return state.keyHolds[note] > 0 || state.pedalHolds[note] != 0;
+}
+
+// Keeps the pitch class mask in step after the holds of a note changed
+void updatePitchClass(ChannelNoteState& state, int note, bool wasSounding)
+{
+	bool sounding = isNoteSounding(state, note);
+	if (sounding == wasSounding) return;
+
+	int pitchClass = note % NOTES_PER_OCTAVE;
+
+	if (sounding) state.pitchClassCounts[pitchClass]++;
+	else state.pitchClassCounts[pitchClass]--;
+
+	if (state.pitchClassCounts[pitchClass] > 0) state.pitchClassMask |= 1 << pitchClass;
+	else state.pitchClassMask &= ~(1 << pitchClass);
+}
+
+void setNote(int channel, int note, int velocity)
+{
+	if (note < 0 || note >= numNotes)
+	{
+		cerr << "WARNING: Invalid note " << note << " on channel " << channel << ". Note message ignored." << endl;
+		return;
+	}
+
+	ChannelNoteState& state = channelNotes[channel];
+	bool wasSounding = isNoteSounding(state, note);
+
+	if (velocity > 0) // turning note on
+	{
+		if (state.keyHolds[note] < 255) state.keyHolds[note]++;
+		if (damperActive[channel]) state.pedalHolds[note] |= DAMPER_HOLD;
+	}
+	
+	else if (velocity == 0) // turning note off
+	{
+		if (state.keyHolds[note] > 0) state.keyHolds[note]--;
+	}
+	
+	else
+	{
+		cerr << "WARNING: Invalid velocity for note " << note << " on channel " << channel << ". Note message ignored." << endl;
+		return;
+	}
+
+	updatePitchClass(state, note, wasSounding);
+}
+
+// Pressing a pedal holds every note sounding on the channel, releasing it lets go of the notes it held
+void setPedalHold(int channel, uint8_t hold, bool enable)
+{
+	ChannelNoteState& state = channelNotes[channel];
+
+	for (int note = 0; note < numNotes; note++)
+	{
+		bool wasSounding = isNoteSounding(state, note);
+
+		if (enable && wasSounding) state.pedalHolds[note] |= hold;
+		else if (!enable) state.pedalHolds[note] &= ~hold;
+
+		updatePitchClass(state, note, wasSounding);
+	}
+}
+
+NoteSet getScale(NoteSet chordScale)
+{
+	const ChordScaleSlot& slot = chordScaleTable[chordScale.mask()];
+
+	if (slot.length == 0)
+	{
+		if (debugMode) cerr << "WARNING - getScale('" << getNoteString(chordScale) << "'): no scale found. Returning provided chord." << endl;
+		return chordScale;
+	}
+
+	NoteSet scale(chordTopScales[chordScale.mask()], 0);
+
+	if (varyScales)
+	{
+		// the same chord always gets the same scale for a given seed
+		uint32_t hash = (scaleVariationSeed ^ chordScale.mask()) * 2654435761u;
+		scale = NoteSet(chordScaleMasks[slot.offset + (hash >> 16) % slot.length], 0);
+	}
+
+	// bright chord tones stay bright
+	uint16_t brightNotes = chordScale.highBits & ~chordScale.lowBits;
+	scale.lowBits &= ~brightNotes;
+	scale.highBits |= brightNotes;
+	
 	if (debugMode)
+		cout << "INFO - getScale('" << getNoteString(chordScale) << "'): returned '" << getNoteString(scale) << "'" << endl;
+
+	return scale;
+}
+
+int64_t monotonicNanoseconds()
+{
+	return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int getLatencyBucket(uint64_t nanoseconds)
+{
+	if (nanoseconds < LATENCY_EXACT_BUCKETS) return nanoseconds;
+
+	int shift = 63 - __builtin_clzll(nanoseconds) - 3; // keep the top 4 bits
+	return LATENCY_EXACT_BUCKETS + (shift - 1) * LATENCY_BUCKETS_PER_OCTAVE + (int)(nanoseconds >> shift) - LATENCY_BUCKETS_PER_OCTAVE;
+}
+
+// largest latency that falls into the bucket
+uint64_t getLatencyBucketLimit(int bucket)
+{
+	if (bucket < LATENCY_EXACT_BUCKETS) return bucket;
+
+	int shift = (bucket - LATENCY_EXACT_BUCKETS) / LATENCY_BUCKETS_PER_OCTAVE + 1;
+	uint64_t top = (bucket - LATENCY_EXACT_BUCKETS) % LATENCY_BUCKETS_PER_OCTAVE + LATENCY_BUCKETS_PER_OCTAVE;
+	return ((top + 1) << shift) - 1;
+}
+
+// Only the writing thread may add, any thread may read
+void addToHistogram(LatencyHistogram& histogram, int64_t elapsed)
+{
+	uint64_t nanoseconds = elapsed > 0 ? elapsed : 0;
+
+	histogram.counts[getLatencyBucket(nanoseconds)].fetch_add(1, memory_order_relaxed);
+	if (nanoseconds > histogram.maxNanoseconds.load(memory_order_relaxed))
+		histogram.maxNanoseconds.store(nanoseconds, memory_order_relaxed);
+}
+
+// Records how long the current event took to reach the stage, once per event
+void recordLatency(LatencyStage stage)
+{
+	if (currentEventStages & (1 << stage)) return;
+	currentEventStages |= 1 << stage;
+
+	addToHistogram(latencyHistograms[stage], monotonicNanoseconds() - currentEventReceived);
+}
+
+uint64_t getLatencyPercentile(const LatencyHistogram& histogram, uint64_t total, double percentile)
+{
+	uint64_t rank = (uint64_t)ceil(total * percentile / 100);
+	if (rank == 0) rank = 1;
+
+	uint64_t seen = 0;
+	for (int bucket = 0; bucket < NUM_LATENCY_BUCKETS; bucket++)
+	{
+		seen += histogram.counts[bucket].load(memory_order_relaxed);
+		if (seen >= rank) return min(getLatencyBucketLimit(bucket), histogram.maxNanoseconds.load(memory_order_relaxed));
+	}
+
+	return histogram.maxNanoseconds.load(memory_order_relaxed);
+}
+
+void displayHistogram(const char* name, const LatencyHistogram& histogram)
+{
+	uint64_t total = 0;
+	for (int bucket = 0; bucket < NUM_LATENCY_BUCKETS; bucket++)
+		total += histogram.counts[bucket].load(memory_order_relaxed);
+
+	cout << "  " << left << setw(14) << name << right << "count: " << setw(8) << total;
+
+	if (total > 0)
+	{
+		cout << fixed << setprecision(1)
+			<< " | p50: " << setw(9) << getLatencyPercentile(histogram, total, 50) / 1000.0
+			<< " | p99: " << setw(9) << getLatencyPercentile(histogram, total, 99) / 1000.0
+			<< " | max: " << setw(9) << histogram.maxNanoseconds.load(memory_order_relaxed) / 1000.0;
+		cout.unsetf(ios::floatfield);
+		cout << setprecision(6);
+	}
+
+	cout << endl;
+}
+
+void displayLatencyStatistics()
+{
+	cout << "Realtime latency since the message was received (microseconds):" << endl;
+
+	for (int stage = 0; stage < NUM_LATENCY_STAGES; stage++)
+	{
+		displayHistogram(LATENCY_STAGE_NAMES[stage], latencyHistograms[stage]);
+	}
+}
+
+void onLatencyReportSignal(int signalNumber)
+{
+	latencyReportRequested = 1;
+}
+
+// Sends note messages only for the notes whose brightness differs from what the channel last showed
+uint16_t getChangedNotes(NoteSet first, NoteSet second)
+{
+	return (first.lowBits ^ second.lowBits) | (first.highBits ^ second.highBits);
+}
+
+int countScheduledChanges()
+{
+	int numChanges = 0;
+
+	for (int channel = 0; channel < NUM_OUTPUT_CHANNELS; channel++)
+	{
+		numChanges += __builtin_popcount(getChangedNotes(scheduledFrames[channel], emittedFrames[channel]));
+	}
+
+	return numChanges;
+}
+
+// Queues the frame in place of whatever the channel still had queued
+bool scheduleFrame(int channel, NoteSet frame)
+{
+	NoteSet emittedFrame = emittedFrames[channel];
+	NoteSet& scheduledFrame = scheduledFrames[channel];
+
+	uint16_t queuedNotes = getChangedNotes(scheduledFrame, emittedFrame);
+	uint16_t changedNotes = getChangedNotes(frame, scheduledFrame);
+
+	for (uint16_t notes = queuedNotes & changedNotes; notes != 0; notes &= notes - 1)
+	{
+		int noteIndex = __builtin_ctz(notes);
+
+		if (frame.brightness(noteIndex) == emittedFrame.brightness(noteIndex))
+			scheduledChangesDropped.fetch_add(1, memory_order_relaxed);
+		else
+			scheduledChangesSuperseded.fetch_add(1, memory_order_relaxed);
+	}
+
+	scheduledFrame = frame;
+
+	int depth = countScheduledChanges();
+	scheduledQueueDepth.store(depth, memory_order_relaxed);
+	if (depth > maxScheduledQueueDepth.load(memory_order_relaxed)) maxScheduledQueueDepth.store(depth, memory_order_relaxed);
+
+	return changedNotes != 0;
+}
+
+// Finds the queued change that matters most: new chord tones (bright), then scale tones (dim), then notes turning off
+bool getNextScheduledChange(int& channel, int& noteIndex, int& noteBrightness)
+{
+	for (noteBrightness = 2; noteBrightness >= 0; noteBrightness--)
+	{
+		for (channel = 0; channel < NUM_OUTPUT_CHANNELS; channel++)
+		{
+			NoteSet scheduledFrame = scheduledFrames[channel];
+			uint16_t queuedNotes = getChangedNotes(scheduledFrame, emittedFrames[channel]);
+
+			for (uint16_t notes = queuedNotes; notes != 0; notes &= notes - 1)
+			{
+				noteIndex = __builtin_ctz(notes);
+				if (scheduledFrame.brightness(noteIndex) == noteBrightness) return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+// Keeps the link busy for the time the bytes take on the wire
+void occupyLink(int64_t now, int numBytes)
+{
+	linkIdleNanoseconds = max(linkIdleNanoseconds, now) + (int64_t)numBytes * BITS_PER_MIDI_BYTE * 1000000000 / linkBaudRate;
+}
+
+// Sends queued changes while the link is idle, returns whether anything is still queued
+bool pumpOutputScheduler()
+{
+	int64_t now = monotonicNanoseconds();
+
+	while (linkIdleNanoseconds <= now)
+	{
+		int channel, noteIndex, noteBrightness;
+
+		if (!getNextScheduledChange(channel, noteIndex, noteBrightness))
+		{
+			if (!scheduledUpdatePending) return false;
+
+			sendUpdateMessage();
+			occupyLink(now, NOTE_MESSAGE_SIZE);
+			scheduledUpdatePending = false;
+			continue;
+		}
+
+		// show the more important changes before moving on to the next kind
+		if (scheduledUpdatePending && noteBrightness < lastScheduledBrightness)
+		{
+			sendUpdateMessage();
+			occupyLink(now, NOTE_MESSAGE_SIZE);
+			scheduledUpdatePending = false;
+			continue;
+		}
+
+		if (compactFrames)
+		{
+			sendFrameMessage(channel, scheduledFrames[channel]);
+			occupyLink(now, FRAME_MESSAGE_SIZE);
+			emittedFrames[channel] = scheduledFrames[channel];
+		}
+		else
+		{
+			sendNoteMessages(channel, noteIndex, noteBrightness);
+			occupyLink(now, noteMessageTable[channel][noteIndex][noteBrightness].numMessages * NOTE_MESSAGE_SIZE);
+			emittedFrames[channel].setBrightness(noteIndex, noteBrightness);
+		}
+
+		scheduledMessagesSent.fetch_add(1, memory_order_relaxed);
+		scheduledQueueDepth.store(countScheduledChanges(), memory_order_relaxed);
+		scheduledUpdatePending = true;
+		lastScheduledBrightness = noteBrightness;
+	}
+
+	return true;
+}
+
+// Sends everything still queued at link speed, for when nothing else will pump the scheduler
+void drainOutputScheduler()
+{
+	while (pumpOutputScheduler()) this_thread::sleep_for(chrono::milliseconds(ENGINE_WAIT_MILLISECONDS));
+}
+
+bool outputFrame(int channel, NoteSet frame)
+{
+	if (scheduleOutput) return scheduleFrame(channel, frame);
+
+	NoteSet& emittedFrame = emittedFrames[channel];
+	uint16_t changedNotes = (frame.lowBits ^ emittedFrame.lowBits) | (frame.highBits ^ emittedFrame.highBits);
+
+	if (compactFrames)
+	{
+		if (changedNotes != 0) sendFrameMessage(channel, frame);
+	}
+	else
+	{
+		for (uint16_t notes = changedNotes; notes != 0; notes &= notes - 1)
+		{
+			int noteIndex = __builtin_ctz(notes);
+			sendNoteMessages(channel, noteIndex, frame.brightness(noteIndex));
+		}
+	}
+
+	emittedFrame = frame;
+	return changedNotes != 0;
+}
+
+// Sleeps until close to the deadline and spins the rest of the way, returns false when playback was stopped
+bool waitForDeadline(int64_t deadline)
+{
+	while (playbackRunning)
+	{
+		if (scheduleOutput) pumpOutputScheduler(); // the link keeps sending queued changes between events
+
+		int64_t remaining = deadline - monotonicNanoseconds() - PLAYBACK_SPIN_NANOSECONDS;
+		if (remaining <= 0) break;
+		if (scheduleOutput) remaining = min(remaining, (int64_t)ENGINE_WAIT_MILLISECONDS * 1000000);
+
+		unique_lock<mutex> lock(playbackWakeMutex);
+		playbackWakeCondition.wait_for(lock, chrono::nanoseconds(remaining), [] { return !playbackRunning; });
+	}
+
+	while (playbackRunning && monotonicNanoseconds() < deadline) {}
+
+	return playbackRunning;
+}
+
+// With --link-rate, playback goes through the output scheduler as LED frames instead of being sent as written
+void schedulePlaybackEvent(const PlaybackEvent& event, NoteSet* frames)
+{
+	int channel = (event.bytes[0] & 0x0F) - STARTING_CHANNEL;
+	unsigned char command = event.bytes[0] & 0xF0;
+
+	if (event.bytes[0] == 0xF0)
+	{
+		uint8_t brightness[NOTES_PER_OCTAVE];
+		if (!decodeFrameMessage(event.bytes, channel, brightness)) return;
+
+		for (int noteIndex = 0; noteIndex < NOTES_PER_OCTAVE; noteIndex++)
+			frames[channel].setBrightness(noteIndex, brightness[noteIndex]);
+	}
+	else if (command == noteOnCodeMin || command == noteOffCodeMin)
+	{
+		int velocity = command == noteOnCodeMin ? event.bytes[2] : 0;
+		frames[channel].setBrightness(event.bytes[1] % NOTES_PER_OCTAVE, getVelocityBrightness(velocity));
+	}
+	else
+	{
+		return; // the scheduler sends its own updates
+	}
+
+	outputFrame(channel, frames[channel]);
+	pumpOutputScheduler();
+}
+
+void runPlayback(int beatsPerMinute, int64_t numTicks)
+{
+	NoteSet frames[NUM_CHANNELS]; // what the song shows so far, for the output scheduler
+
+	// every deadline is an offset from the same start, so timing errors never add up
+	double nanosecondsPerTick = 60e9 / ((double)beatsPerMinute * TICKS_PER_QUARTER_NOTE);
+	int64_t startNanoseconds = monotonicNanoseconds();
+
+	for (uint64_t loop = 0; playbackRunning; loop++)
+	{
+		double loopTick = (double)loop * numTicks; // a repeat starts right where the song ends
+
+		for (int i = 0; i < playbackEvents.size(); i++)
+		{
+			const PlaybackEvent& event = playbackEvents[i];
+			int64_t deadline = startNanoseconds + (int64_t)((loopTick + event.tick) * nanosecondsPerTick);
+
+			if (!waitForDeadline(deadline)) return;
+
+			if (scheduleOutput)
+				schedulePlaybackEvent(event, frames);
+			else
+				sendOutputMessage(event.bytes, event.size);
+			addToHistogram(playbackJitter, monotonicNanoseconds() - deadline);
+		}
+
+		playbackLoops++;
+		if (!loopMode) break;
+	}
+
+	playbackRunning = false;
+}
+
+void startPlayback(const Song& song)
+{
+	playbackRunning = true;
+	playbackThread = thread(runPlayback, song.beatsPerMinute, song.numTicks);
+}
+
+// Turns off every LED the song may have left lit
+void clearPlaybackOutput()
+{
+	if (scheduleOutput)
+	{
+		for (int channel = 0; channel < NUM_CHANNELS; channel++)
+			outputFrame(channel, NoteSet());
+
+		drainOutputScheduler();
+		return;
+	}
+
+	for (int channel = 0; channel < NUM_CHANNELS; channel++)
+	{
+		if (compactFrames)
+		{
+			sendFrameMessage(channel, NoteSet());
+			continue;
+		}
+
+		for (int noteIndex = 0; noteIndex < NOTES_PER_OCTAVE; noteIndex++)
+		{
+			sendNoteMessages(channel, noteIndex, 0);
+		}
+	}
+
+	sendUpdateMessage();
+}
+
+void displayPlaybackStatistics()
+{
+	cout << "Playback: " << playbackEvents.size() << " events per pass | Passes: " << playbackLoops << endl;
+	cout << "Playback jitter after each deadline (microseconds):" << endl;
+	displayHistogram("send", playbackJitter);
+}
+
+void outputScale(NoteSet scale)
+{
+	// bright notes that are both dim and bright are bass notes, shown bright on the bass channel when indicated
+	uint16_t bassNotes = scale.lowBits & scale.highBits;
+	NoteSet frame(scale.lowBits & ~bassNotes, scale.highBits);
+	NoteSet bassFrame;
+
+	if (indicateBass)
+	{
+		frame.highBits &= ~bassNotes;
+		bassFrame.highBits = bassNotes;
+	}
+
+	bool changed = outputFrame(REALTIME_CHANNEL, frame);
+	if (outputFrame(REALTIME_BASS_NOTE_CHANNEL, bassFrame)) changed = true;
+
+	if (changed)
+	{
+		if (scheduleOutput)
+			pumpOutputScheduler(); // the update follows once the link has sent the changes
+		else
+			sendUpdateMessage();
+
+		recordLatency(OUTPUT_SENT);
+	}
+}
+
+void setPriorityScale(NoteSet chord, NoteSet scale)
+{
+	if (debugMode) cout << "INFO - setPriorityScale('" << getNoteString(chord) << "', '" << getNoteString(scale) << "')" << endl;
+
+	uint16_t normalizedChord = chord.highBits & ~chord.lowBits;
+	uint16_t normalizedScale = scale.mask();
+
+	if (chordScaleTable[normalizedChord].length == 0)
+	{
+		if (debugMode) cerr << "WARNING - setPriorityScale('" << getNoteString(chord) << "', '" << getNoteString(scale) << "'): normalized chord '" << getNoteString(NoteSet(normalizedChord, 0)) << "' not found. Ignoring..." << endl;
+		return;
+	}
+
+	if (!prioritizeScale(normalizedChord, normalizedScale))
+	{
+		if (debugMode) cerr << "WARNING - setPriorityScale('" << getNoteString(chord) << "', '" << getNoteString(scale) << "'): scale is not mapped to normalized chord '" << getNoteString(NoteSet(normalizedChord, 0)) << "'. Ignoring..." << endl;
+		return;
+	}
+
+	journalPriorityChange(normalizedChord, normalizedScale);
+}
+
+void activateRealtime(bool enable, int channel)
+{
+	if (enable)
+	{
+		// light the sounding pitch classes that aren't lit yet
+		uint16_t newNotes = channelNotes[channel].pitchClassMask & ~activeChordScale.mask();
+		if (realtimeActive[channel])
+			activeChordScale.lowBits |= newNotes;
+		else
+			activeChordScale.highBits |= newNotes;
+
+		recordLatency(STATE_UPDATED);
+
+		NoteSet suggestedScale = getScale(activeChordScale);
+		recordLatency(SCALE_CHOSEN);
+
+		if (!suggestedScale.empty() && activeSuggestedScale != suggestedScale)
+		{
+			if (realtimeActive[channel])
+			{
+				setPriorityScale(activeChordScale, suggestedScale);
+			}
+
+			activeSuggestedScale = suggestedScale;	
+			outputScale(suggestedScale);
+		}
+
+		realtimeActive[channel] = true;
+	}
+	else
+	{
+		realtimeActive[channel] = false;
+		activeChordScale = NoteSet();
+		activeSuggestedScale = NoteSet();
+		recordLatency(STATE_UPDATED);
+
+		outputScale(NoteSet());
+	}
+}
+
+void handleActivateRealtimeMessage(bool enable, int channel)
+{
+	if (enable)
+	{
+		if (realtimeActive[channel])
+		{
+			if (debugMode) std::cerr << "WARNING: Received realtime ON request, but realtime is already active. Ignoring request." << std::endl;
+			return;	
+		}
+	}
+	else
+	{
+		if (!realtimeActive[channel])
+		{
+			if (debugMode) std::cerr << "WARNING: Received realtime OFF request, but realtime is not currently active. Ignoring request." << std::endl;
+			return;
+		}
+	}
+
+	activateRealtime(enable, channel);
+}
+
+void handleDamperMessage(bool enable, int channel)
+{
+	if (enable)
+	{
+		if (damperActive[channel])
+		{
+			if (debugMode) cerr << "WARNING: Received damper ON request, but damper is already active. Ignoring request." << endl;
+			return;
+		}
+
+		damperActive[channel] = true;
+		setPedalHold(channel, DAMPER_HOLD, true);
+	}
+	else
 	{
-		cout << "Constructing SET_TEMPO message with BPM=" << bpm << ": " << endl;
-		for (int i = 0; i < setTempoMessage.size(); i++)
+		if (!damperActive[channel])
 		{
-			printf("[%d]: 0x%X\n", i, setTempoMessage[i]);
+			if (debugMode) cerr << "WARNING: Received damper OFF request, but damper is not currently active. Ignoring request." << endl;
+			return;
 		}
-		cout << endl;
+
+		damperActive[channel] = false;
+		setPedalHold(channel, DAMPER_HOLD, false); // turn all damper notes off
+	}
+}
+
+void handleSostenutoMessage(bool enable, int channel)
+{
+	if (enable)
+	{
+		if (sostenutoActive[channel])
+		{
+			if (debugMode) cerr << "WARNING: Received sostenuto ON request, but sostenuto is already active. Ignoring request." << endl;
+			return;
+		}
+
+		sostenutoActive[channel] = true;
+		setPedalHold(channel, SOSTENUTO_HOLD, true);
+	}
+	else
+	{
+		if (!sostenutoActive[channel])
+		{
+			if (debugMode) cerr << "WARNING: Received sostenuto OFF request, but sostenuto is not currently active. Ignoring request." << endl;
+			return;
+		}
+
+		sostenutoActive[channel] = false;
+		setPedalHold(channel, SOSTENUTO_HOLD, false); // turn all sostenuto notes off
+	}
+}
+
+// Applies one queued message to the realtime state, runs on the engine thread
+void processMidiEvent(const MidiInputEvent& event)
+{
+	lastMidiMessageReceived->assign(event.bytes, event.bytes + event.size);
+
+	currentEventReceived = event.receivedNanoseconds;
+	currentEventStages = 0;
+
+	int code = (int) event.bytes[0];
+
+	if (code >= noteOnCodeMin && code <= noteOnCodeMax)
+	{
+		int channel = code - noteOnCodeMin;
+		setNote(channel, event.bytes[1], event.bytes[2]);
+		recordLatency(STATE_UPDATED);
+
+		if (event.bytes[2] > 0 && realtimeMode && realtimeActive[channel])
+		{
+			//activateRealtime(true, channel);
+		}
+	}	
+	else if (code >= noteOffCodeMin && code <= noteOffCodeMax)
+	{
+		int channel = code - noteOffCodeMin;
+		setNote(channel, event.bytes[1], 0);
+		recordLatency(STATE_UPDATED);
+	}
+	else if (code >= ccStatusCodeMin && code <= ccStatusCodeMax)
+	{
+		int ccCode = (int) event.bytes[1];
+		int value = (int) event.bytes[2];
+		int channel = code - (int) ccStatusCodeMin;
+
+		if (ccCode == cc_sostenuto)
+		{
+			handleSostenutoMessage(value > 0, channel);
+		}
+		else if (ccCode == cc_damper)
+		{
+			handleDamperMessage(value > 0, channel);
+		}
+
+		recordLatency(STATE_UPDATED);
+
+		if (ccCode == cc_activate_realtime)
+		{
+			handleActivateRealtimeMessage(value > 0, channel);
+		}
+	}
+}
+
+void runRealtimeEngine()
+{
+	while (true)
+	{
+		uint32_t tail = midiEventQueueTail.load(memory_order_relaxed);
+		uint32_t head = midiEventQueueHead.load(memory_order_acquire);
+
+		if (latencyReportRequested)
+		{
+			latencyReportRequested = 0;
+			displayLatencyStatistics();
+		}
+
+		if (scheduleOutput) pumpOutputScheduler();
+
+		if (tail == head)
+		{
+			if (!engineRunning) // stopped and drained
+			{
+				if (scheduleOutput) drainOutputScheduler();
+				break;
+			}
+
+			unique_lock<mutex> lock(engineWakeMutex);
+			engineWakeCondition.wait_for(lock, chrono::milliseconds(ENGINE_WAIT_MILLISECONDS));
+			continue;
+		}
+
+		for (; tail != head; tail++)
+		{
+			processMidiEvent(midiEventQueue[tail & (MIDI_EVENT_QUEUE_SIZE - 1)]);
+		}
+
+		midiEventQueueTail.store(tail, memory_order_release);
+	}
+}
+
+void startRealtimeEngine()
+{
+#ifndef __WINDOWS_MM__
+	signal(SIGUSR1, onLatencyReportSignal); // kill -USR1 prints the latency so far
+#endif
+
+	engineRunning = true;
+	engineThread = thread(runRealtimeEngine);
+}
+
+// RtMidi callback: never blocks, only copies the message into the event queue
+void onMidiMessageReceived(double deltatime, std::vector<unsigned char>* message, void* userData)
+{
+	midiEventTimestamp += deltatime;
+
+	if (message->size() == 0 || message->size() > 3)
+	{
+		midiEventsDropped.fetch_add(1, memory_order_relaxed);
+		return;
+	}
+
+	uint32_t head = midiEventQueueHead.load(memory_order_relaxed);
+
+	if (head - midiEventQueueTail.load(memory_order_acquire) >= MIDI_EVENT_QUEUE_SIZE)
+	{
+		midiEventQueueOverflows.fetch_add(1, memory_order_relaxed);
+		return;
+	}
+
+	MidiInputEvent& event = midiEventQueue[head & (MIDI_EVENT_QUEUE_SIZE - 1)];
+	event.timestamp = midiEventTimestamp;
+	event.receivedNanoseconds = monotonicNanoseconds();
+	event.size = message->size();
+	memcpy(event.bytes, message->data(), message->size());
+
+	midiEventQueueHead.store(head + 1, memory_order_release);
+	engineWakeCondition.notify_one();
+}
+
+void displayOutputSchedulerStatistics()
+{
+	cout << "Output scheduler (" << linkBaudRate << " baud): " << scheduledMessagesSent << " changes sent | Queue depth: " << scheduledQueueDepth << " (max " << maxScheduledQueueDepth << ") | Superseded: " << scheduledChangesSuperseded << " | Dropped: " << scheduledChangesDropped << endl;
+}
+
+void displayRealtimeEngineStatistics()
+{
+	cout << "MIDI events dropped: " << midiEventsDropped << " | Queue overflows: " << midiEventQueueOverflows << " | Unjournaled priority changes: " << priorityQueueOverflows << endl;
+	displayLatencyStatistics();
+
+	if (scheduleOutput) displayOutputSchedulerStatistics();
+}
+
+void initializeRealtimeState()
+{
+	damperActive = new bool[numChannels];
+	sostenutoActive = new bool[numChannels];
+	realtimeActive = new bool[numChannels];
+
+	for (int i = 0; i < numChannels; i++)
+	{
+		damperActive[i] = false;
+		sostenutoActive[i] = false;
+		realtimeActive[i] = false;
+	}
+
+	for (int channel = 0; channel < NUM_OUTPUT_CHANNELS; channel++)
+	{
+		scheduledFrames[channel] = emittedFrames[channel];
+	}
+
+	lastMidiMessageReceived = new std::vector<unsigned char>();
+}
+
+void initializeMidiOut()
+{
+	midiOut = new RtMidiOut(RtMidi::Api::UNSPECIFIED, DEFAULT_RTMIDI_OUT_NAME);
+	midiOut->openVirtualPort();
+
+	// Connect ALSA Ports
+	if (autoConnectALSAPorts)
+	{
+		string command2 = "aconnect \"" + DEFAULT_ALSA_INPUT_NAME_2 + "\" \"" + DEFAULT_ALSA_OUTPUT_NAME_2 + "\"";
+		
+		system(command2.c_str());
+	}
+}
+
+void initializeRtMidi()
+{
+	initializeRealtimeState();
+
+	midiIn = new RtMidiIn(RtMidi::Api::UNSPECIFIED, DEFAULT_RTMIDI_IN_NAME, 100);
+	midiIn->openVirtualPort();
+	midiIn->setCallback( &onMidiMessageReceived );
+	midiIn->ignoreTypes( true, true, true );
+
+	initializeMidiOut();
+
+	// Connect ALSA Ports
+	if (autoConnectALSAPorts)
+	{
+		string command1 = "aconnect \"" + DEFAULT_ALSA_INPUT_NAME_1 + "\" \"" + DEFAULT_ALSA_OUTPUT_NAME_1 + "\"";
+		
+		system(command1.c_str());
 	}
+}
+
+string getDefaultOutputFilename(const string& inputFilename)
+{
+	int indexOfLastSlash = -1;
+	int indexOfLastPeriod = -1;
+	for (int i = 0; i < inputFilename.size(); i++)
+	{
+		if (inputFilename[i] == '/' || inputFilename[i] == '\\') indexOfLastSlash = i;
+		if (inputFilename[i] == '.') indexOfLastPeriod = i;
+	}
+	return inputFilename.substr(indexOfLastSlash+1,indexOfLastPeriod-indexOfLastSlash-1) + "_CPV.mid";
+}
+
+void initialize(int argc, char** argv)
+{
+	// Initialize variables
+	errorStatus = 0;
+	realtimeMode = false;
+	compileConfigMode = false;
+	embedConfigMode = false;
+	benchmarkMode = false;
+	brightMode = false;
+	indicateBass = false;
+	loopMode = true;
+	debugMode = false;
+	ignoreScales = false;
+	allChordSizes = false;
+	varyScales = false;
+	runningStatus = false;
+	compactFrames = false;
+	scheduleOutput = false;
+	linkBaudRate = DIN_MIDI_BAUD_RATE;
+	playMode = false;
+	scaleVariationSeed = 0;
+	generatedBeats = DEFAULT_GENERATED_BEATS;
+	chordChangeDensity = DEFAULT_CHORD_CHANGE_DENSITY;
+	slashChordRatio = DEFAULT_SLASH_CHORD_RATIO;
+	scaleRatio = DEFAULT_SCALE_RATIO;
+	generatorSeed = 1;
 	
-	for (int channel = 0; channel < NUM_CHANNELS; channel++)
+	chordScaleMappingFilename = "";
+	inputFilename = "";
+	outputFilename = "";
+
+	activeChordScale = NoteSet();
+	activeSuggestedScale = NoteSet();
+
+	// Process command line options
+	parseArgs(argc, argv);
+	
+	for (int i = 1; i < getArgCount(); i++)
+	{
+		if (processOption(i))
+			i++;
+	}
+
+	if (getArgCount() == 1)
+		realtimeMode = true;
+
+	// live playback renders one song and writes no file
+	if (playMode && (batchFilename.size() > 0 || outputFilename.size() > 0))
+	{
+		cerr << "ERROR: " << PLAY_OPTION << " can not be combined with " << BATCH_OPTION << " or " << OUTPUT_FILE_OPTION << endl;
+		errorStatus = 1;
+		end(errorStatus);
+	}
+
+	// the rendered file owns stdout, everything else printed goes to stderr
+	standardOutputBuffer = cout.rdbuf();
+	if (outputFilename == STANDARD_OUTPUT_FILENAME)
+	{
+		cout.rdbuf(cerr.rdbuf());
+	}
+
+	buildNoteMessageTable();
+
+	bool chordScaleMappingSpecified = chordScaleMappingFilename.size() > 0;
+
+	if (!chordScaleMappingSpecified)
+	{
+		chordScaleMappingFilename = DEFAULT_CHORD_SCALE_MAPPING_FILENAME;
+	}
+
+	bool configBundleLoaded = false;
+
+	// the benchmarks load the config themselves
+	if (benchmarkMode) return;
+
+	if (compileConfigMode || embedConfigMode)
+	{
+		loadConfig();
+		loadOrGenerateChordScaleMapping(chordScaleMappingFilename);
+
+		if (compileConfigMode)
+		{
+			writeConfigBundle(DEFAULT_CONFIG_BUNDLE_FILENAME, chordScaleMappingFilename);
+			cout << endl << "Config bundle '" << DEFAULT_CONFIG_BUNDLE_FILENAME << "' compiled from '" << CHORD_LIST_FILENAME << "', '" << SCALE_LIST_FILENAME << "' and '" << chordScaleMappingFilename << "'." << endl << endl;
+		}
+
+		if (embedConfigMode)
+		{
+			writeConfigHeader(DEFAULT_CONFIG_HEADER_FILENAME, chordScaleMappingFilename);
+			cout << endl << "Config header '" << DEFAULT_CONFIG_HEADER_FILENAME << "' generated from '" << CHORD_LIST_FILENAME << "', '" << SCALE_LIST_FILENAME << "' and '" << chordScaleMappingFilename << "'." << endl << endl;
+		}
+
+		end(errorStatus);
+	}
+
+#ifdef EMBEDDED_CONFIG
+	// Defaults are compiled in; a mapping file given on the command line still overrides the embedded table
+	loadEmbeddedConfig(!chordScaleMappingSpecified);
+	configBundleLoaded = !chordScaleMappingSpecified;
+#else
+	// Use the compiled config bundle when it is up to date, otherwise parse the config files
+	configBundleLoaded = loadConfigBundle(DEFAULT_CONFIG_BUNDLE_FILENAME, chordScaleMappingFilename);
+
+	if (!configBundleLoaded)
+	{
+		loadConfig();
+	}
+#endif
+
+	if (generatedFilename.size() > 0)
+	{
+		generateProgressionFile(generatedFilename);
+		end(errorStatus);
+	}
+
+	if (realtimeMode)
+	{
+		initializeRtMidi();
+
+		if (!configBundleLoaded)
+		{
+			loadOrGenerateChordScaleMapping(chordScaleMappingFilename);
+		}
+
+		startPriorityJournal(chordScaleMappingFilename);
+
+		// messages received while loading stay queued until the mapping is ready
+		startRealtimeEngine();
+
+		cout << endl << "Realtime mode active." << endl << endl;
+
+		return;
+	}
+	
+	if (batchFilename.size() > 0)
+	{
+		// -o names the output directory in batch mode
+		return;
+	}
+
+	if (inputFilename.size() == 0)
 	{
-		midiOutputFile.addEvent(channel, 0, setTempoMessage); // add tempo change at start of each channel
+		cerr << "Please specify either an input file (-i), a batch (--batch) or realtime mode (-t)." << endl;
+		errorStatus = 1;
+		end(errorStatus);
 	}
-	*/
 	
-	for (int channel = 0; channel < NUM_CHANNELS; channel++)
+	if (outputFilename.size() == 0)
 	{
-		midiOutputFile.addTempo(channel, 0, bpm);
+		outputFilename = getDefaultOutputFilename(inputFilename);
 	}
-	
 }
 
-// Adds note on or off message to output file for the specified note on all octaves on the specified channel with the specified time
-void addNoteMessage(int channel, int noteIndex, int noteBrightness, int ticks)
+void displaySettings()
 {
-	unsigned char statusByte = 0x90; // note on message
-	if (noteBrightness == 0) // note off message
-		statusByte = 0x80;
-	statusByte += channel + STARTING_CHANNEL;
-	
-	unsigned char velocityByte = 0x00;
-	if (noteBrightness == 1)
-		velocityByte = dimNoteVelocity;
-	else if (noteBrightness == 2)
-		velocityByte = brightNoteVelocity;
-		
-	unsigned char pitchByte;
-	for (int octave = STARTING_OCTAVE; octave < ENDING_OCTAVE || octave == ENDING_OCTAVE && noteIndex == 0; octave++)
+	cout << endl << "Settings: " << endl;
+
+	cout << "Loop mode (enabled by default): " << boolToText(loopMode) << endl;
+	cout << "Indicate bass (disabled by default): " << boolToText(indicateBass) << endl;
+	cout << "Bright mode (disabled by default): " << boolToText(brightMode) << endl;
+	cout << "Chords only (disabled by default): " << boolToText(ignoreScales) << endl;
+	cout << "Vary scales (disabled by default): " << boolToText(varyScales);
+	if (varyScales) cout << " (seed " << scaleVariationSeed << ")";
+	cout << endl;
+	cout << "Running status (disabled by default): " << boolToText(runningStatus) << endl;
+	cout << "Compact frames (disabled by default): " << boolToText(compactFrames) << endl;
+	cout << "Link rate (unlimited by default): ";
+	if (scheduleOutput) cout << linkBaudRate << " baud" << endl;
+	else cout << "Unlimited" << endl;
+	cout << "Play (disabled by default): " << boolToText(playMode) << endl;
+	cout << "Octaves (" << STARTING_OCTAVE << "-" << ENDING_OCTAVE << " by default):";
+	for (int channel = 0; channel < NUM_OUTPUT_CHANNELS; channel++)
 	{
-		pitchByte = (NOTES_PER_OCTAVE*octave)+noteIndex;
-		
-		vector<unsigned char> noteMessage;
-		noteMessage.push_back(statusByte);
-		noteMessage.push_back(pitchByte);
-		noteMessage.push_back(velocityByte);
-		
-		if (ticks < 0)
-		{
-			midiOut->sendMessage(&noteMessage);
-		}
-		else
-		{
-			midiOutputFile.addEvent(channel, ticks, noteMessage);
-		}
-		
-		if (debugMode)
-		{
-			cout << "Created the following note message with the following parameters:" << endl;
-			cout << "Channel: " << channel << " | Note Index: " << noteIndex << " | Note Brightness: " << noteBrightness << " | Ticks: " << ticks << endl;
-			cout << "Message: ";
-			for (int i = 0; i < noteMessage.size(); i++)
-			{
-				printf("0x%X ", noteMessage[i]);
-			}
-			cout << endl;
-			cout << endl;
-		}
+		cout << " " << OUTPUT_CHANNEL_NAMES[channel] << " " << channelPitchRanges[channel].lowest / NOTES_PER_OCTAVE << "-" << channelPitchRanges[channel].highest / NOTES_PER_OCTAVE;
 	}
+	cout << endl;
+	
+	cout << endl;
 }
 
-void clearAllNotesForChannel(int channel, int ticks)
+void displayChordScaleMapping()
 {
-	for (int noteIndex = 0; noteIndex < EMPTY_NOTE_STRING.size(); noteIndex++)
-	{
-		addNoteMessage(channel, noteIndex, 0, ticks);
-	}
+	cout << "Chord Scale Mapping (" << chordScaleMappingFilename << "): " << endl;
+	cout << getChordScaleMappingString();
+	cout << endl;
 }
 
-void clearAllNotes(int ticks)
+void displayChordMapping()
 {
-	for (int channel = 0; channel < NUM_CHANNELS; channel++)
+	cout << "Chord Types: " << endl;
+	for (map<string, NoteSet>::const_iterator it = chordMap.begin(); it != chordMap.end(); it++)
 	{
-		clearAllNotesForChannel(channel, ticks);
-	}
+		cout << it->first << "   :   " << getNoteString(it->second) << endl;
+	}	
+	cout << endl;
 }
 
-void addEndOfTrackMessage(int channel, int ticks)
+void displayScaleMapping()
 {
-	clearAllNotesForChannel(channel, ticks);		
-	/*
-	unsigned char statusByte = 0xFF; // meta message
-	unsigned char metaByte = 0x2F; // end track message
-	unsigned char lengthByte = 0x00; // no data bytes for this message
-
-	vector<unsigned char> endOfTrackMessage;
-	endOfTrackMessage.push_back(statusByte);
-	endOfTrackMessage.push_back(metaByte);
-	endOfTrackMessage.push_back(lengthByte);
-		
-	midiOutputFile.addEvent(channel, ticks, endOfTrackMessage);
-		
-		if (debugMode)
+	cout << "Scale Types: " << endl;
+	for (map<string, NoteSet>::const_iterator it = scaleMap.begin(); it != scaleMap.end(); it++)
 	{
-		cout << "Created the following end track message with the following parameters:" << endl;
-		cout << "Channel: " << channel << " | Ticks: " << ticks << endl;
-		cout << "Message: ";
-		for (int i = 0; i < endOfTrackMessage.size(); i++)
-		{
-			printf("0x%X ", endOfTrackMessage[i]);
-		}
-		cout << endl;
-		cout << endl;
-	}
-	*/
+		cout << it->first << "   :   " << getNoteString(it->second) << endl;
+	}	
+	cout << endl;
 }
 
-void endAllTracks(int ticks)
+void realtimeLoop()
 {
-	for (int channel = 0; channel < NUM_CHANNELS; channel++)
+	char input;
+	while (cin.get(input))
 	{
-		if (!indicateBass && channel == BASS_NOTE_CHANNEL) continue;
-		addEndOfTrackMessage(channel, ticks);
+
 	}
+	cin.clear();
+	cout << endl << "Received EOF." << endl;
 }
 
-void addUpdateMessage(int ticks)
+string getFormattedTimestamp()
 {
-	int channel = EVEN_CHORD_CHANNEL;
-	
-	if (indicateBass)
-		channel = BASS_NOTE_CHANNEL;
-	
-	unsigned char statusByte = 0xB0 + channel + STARTING_CHANNEL; // control change message
-	unsigned char dataByte = UPDATE_ALL_MESSAGE_CODE;
-	unsigned char valueByte = 0X7F; // max on signal
+	time_t rawtime;
+	struct tm * timeinfo;
+	char buffer[80];
+
+	time (&rawtime);
+	timeinfo = localtime(&rawtime);
 	
-	vector<unsigned char> updateMessage;
-	updateMessage.push_back(statusByte);
-	updateMessage.push_back(dataByte);
-	updateMessage.push_back(valueByte);
-		
-	if (ticks < 0)
+	strftime(buffer,sizeof(buffer),"%m-%d-%Y_%I:%M:%S",timeinfo);
+	string str(buffer);
+
+	return str;
+}
+
+void wouldYouLikeToSave()
+{
+	cout << "Would you like to save changes to chord-scale priority?" << endl;
+	cout << "1) Yes" << endl;
+	cout << "2) No" << endl;
+	cout << "Please enter a number: ";
+
+	int input;
+	cin >> input;
+	cout << endl;
+
+	if (input == 1)
 	{
-		midiOut->sendMessage(&updateMessage);
+		cout << "Would you like to create a new file or overwrite '" << chordScaleMappingFilename << "'?" << endl;
+		cout << "1) Save to new file" << endl;
+		cout << "2) Overwrite" << endl;
+		cout << "Please enter a number: ";
+
+		cin >> input;
+		cout << endl;
+
+		string fileToSaveTo = "";
+
+		if (input == 2)
+		{
+			fileToSaveTo = chordScaleMappingFilename;
+		}
+		else
+		{
+			fileToSaveTo = chordScaleMappingFilename.substr(0, chordScaleMappingFilename.find_last_of(".")) + "[" + getFormattedTimestamp() + "]" + chordScaleMappingFilename.substr(chordScaleMappingFilename.find_last_of("."), chordScaleMappingFilename.size());
+		}
+
+		writeChordScaleMapping(fileToSaveTo);
+		cout << "Changes have been saved to '" << fileToSaveTo << "'." << endl;
 	}
 	else
 	{
-		midiOutputFile.addEvent(channel, ticks, updateMessage);
+		cout << "Changes will not be saved." << endl;
 	}
-		
+}
+
+// Builds the notes of every channel, ready to be written or played
+bool prepareSong(Song& song)
+{
 	if (debugMode)
 	{
-		cout << "Created the following update message with the following parameters:" << endl;
-		cout << "Ticks: " << ticks << endl;
-		cout << "Message: ";
-		for (int i = 0; i < updateMessage.size(); i++)
+		cout << "BPM: " << song.beatsPerMinute << endl;
+		cout << endl;
+		
+		cout << "Number of Beats: " << song.numBeats << endl;
+		cout << endl;
+	
+		cout << "Chord Progression: " << endl;
+		for (int i = 0; i < song.progression.size(); i++)
 		{
-			printf("0x%X ", updateMessage[i]);
+			string symbol = getSymbolText(song, song.progression[i].chord);
+			cout << "[" << i << "]: " << symbol << " | Root: " << getRoot(symbol) << " | Bass: " << getBass(symbol) << " | Type: " << getChordType(symbol) << " | Ticks: " << song.progression[i].startTick << " + " << song.progression[i].duration << endl;
 		}
 		cout << endl;
+	
+		cout << "Scale Progression: " << endl;
+		for (int i = 0; i < song.progression.size(); i++)
+		{
+			string symbol = getSymbolText(song, song.progression[i].scale);
+			cout << "[" << i << "]: " << symbol << " | Root: " << getRoot(symbol) << " | Bass: " << getBass(symbol) << " | Type: " << getChordType(symbol) << endl;
+		}
 		cout << endl;
 	}
-}
 
-void addUpdateMessage(int ticks, int channel)
-{
-	unsigned char statusByte = 0xB0 + channel + STARTING_CHANNEL; // control change message
-	unsigned char dataByte = UPDATE_CHANNEL_MESSAGE_CODE;
-	unsigned char valueByte = 0X7F; // max on signal
+	if (!generateNoteProgression(song))
+		return false;
 	
-	vector<unsigned char> updateMessage;
-	updateMessage.push_back(statusByte);
-	updateMessage.push_back(dataByte);
-	updateMessage.push_back(valueByte);
-		
-	if (ticks < 0)
-	{
-		midiOut->sendMessage(&updateMessage);
-	}
-	else
+	if (debugMode)
 	{
-		midiOutputFile.addEvent(channel, ticks, updateMessage);
+		cout << "Note Progression: " << endl;
+		for (int i = 0; i < song.noteProgression.size(); i++)
+			cout << "[" << i << "]: " << getNoteString(song.noteProgression[i]) << endl;	
+		cout << endl;
 	}
 		
+	separateNoteProgressionByChannel(song);
+	
 	if (debugMode)
 	{
-		cout << "Created the following update message with the following parameters:" << endl;
-		cout << "Ticks: " << ticks << endl;
-		cout << "Channel: " << channel << endl;
-		cout << "Message: ";
-		for (int i = 0; i < updateMessage.size(); i++)
+		cout << "Note Progression by Channel: " << endl;
+		for (int i = 0; i < NUM_CHANNELS; i++)
 		{
-			printf("0x%X ", updateMessage[i]);
+			for (int j = 0; j < song.noteProgressionByChannel[i].size(); j++)
+			{
+				cout << "[" << i << "][" << j << "]: " << getNoteString(song.noteProgressionByChannel[i][j]) << endl;
+			}
 		}
 		cout << endl;
+		
+		cout << "Chord changes: " << endl;
+		for (int i = 0; i < song.chordChanges.size(); i++)
+			cout << "[" << i << "]: " << "Segment #" << song.chordChanges[i] << " | Tick: " << song.progression[song.chordChanges[i]].startTick << endl;
 		cout << endl;
 	}
+	
+	return true;
 }
 
-void createMidiFile()
+bool renderSong(Song& song)
 {
-	// Create MIDI file
-	// Add tempo midi event
-	// Add note ons and note offs for every octave based on chord changes to the appropriate channel
-	// Make sure to use blinking lead-in
-	// Write MIDI file
-	
-	// initialize midi file
-	
-	midiOutputFile.absoluteTicks();
-	midiOutputFile.addTrack(NUM_CHANNELS-1); // 1 channel already present
-	midiOutputFile.setTicksPerQuarterNote(TICKS_PER_QUARTER_NOTE);
-	
-	setTempo(beatsPerMinute);
+	if (!prepareSong(song))
+		return false;
 
-	
-	// add first chord
+	createMidiFile(song);
 
-	for (int channel = 0; channel < NUM_CHANNELS; channel++)
+	return true;
+}
+
+// Plays the song on midiOut until it ends, or until EOF when it loops
+void playSong(Song& song)
+{
+	if (!prepareSong(song)) return;
+
+	// live playback sends the events instead of writing them
+	collectPlaybackEvents(song);
+
+	initializeMidiOut();
+	startPlayback(song);
+
+	cout << endl << "Playing '" << song.inputFilename << "'" << (loopMode ? " until EOF." : ".") << endl;
+
+	if (loopMode) realtimeLoop();
+	stopPlayback(!loopMode);
+
+	clearPlaybackOutput();
+
+	cout << endl;
+	displayPlaybackStatistics();
+	if (scheduleOutput) displayOutputSchedulerStatistics();
+	cout << endl;
+}
+
+// Render cache: finished MIDI files are stored under a hash of everything that affects them
+
+const uint64_t RENDER_CACHE_VERSION = 3; // bump whenever createMidiFile() output changes
+
+uint64_t renderCacheConfigHash;
+atomic<int> renderCacheHits(0);
+atomic<int> renderCacheMisses(0);
+
+// 64-bit FNV-1a, chainable by passing the previous hash
+uint64_t getContentHash(const void* data, size_t size, uint64_t hash = 14695981039346656037ull)
+{
+	const unsigned char* bytes = (const unsigned char*)data;
+
+	for (size_t i = 0; i < size; i++)
 	{
-		if (channel == BASS_NOTE_CHANNEL && !indicateBass) continue;
+		hash ^= bytes[i];
+		hash *= 1099511628211ull;
+	}
 
-		for (int noteIndex = 0; noteIndex < EMPTY_NOTE_STRING.size(); noteIndex++)
-		{
-			int noteBrightness = noteProgressionByChannel[channel][0][noteIndex]-'0';
-			if (noteBrightness > 0)
-			{
-				int tickOffset = noteIndex+1;
-				tickOffset = 2;
-				addNoteMessage(channel, noteIndex, noteBrightness, 0+tickOffset);
-			}
-		}
+	return hash;
+}
+
+uint64_t getContentHash(const map<string, NoteSet>& names, uint64_t hash)
+{
+	for (map<string, NoteSet>::const_iterator it = names.begin(); it != names.end(); it++)
+	{
+		hash = getContentHash(it->first.c_str(), it->first.size() + 1, hash);
+		hash = getContentHash(&it->second.lowBits, sizeof(it->second.lowBits), hash);
+		hash = getContentHash(&it->second.highBits, sizeof(it->second.highBits), hash);
 	}
-	int tickOffset = 8;
-	addUpdateMessage(0 + tickOffset);
-		
-	
-	// add all chord changes
 
-	for (int chordChange = 0; chordChange < chordChanges.size(); chordChange++)
+	return hash;
+}
+
+bool readFileContents(const string& filename, string& contents)
+{
+	ifstream inputStream(filename.c_str(), ios::binary);
+	if (!inputStream) return false;
+
+	stringstream ss;
+	ss << inputStream.rdbuf();
+	contents = ss.str();
+
+	return true;
+}
+
+bool copyFile(const string& fromFilename, const string& toFilename)
+{
+	ifstream inputStream(fromFilename.c_str(), ios::binary);
+	ofstream outputStream(toFilename.c_str(), ios::binary | ios::trunc);
+	if (!inputStream || !outputStream) return false;
+
+	outputStream << inputStream.rdbuf();
+
+	return outputStream.good();
+}
+
+// Hardlinks when the filesystem allows it, otherwise copies
+bool linkOrCopyFile(const string& fromFilename, const string& toFilename)
+{
+	remove(toFilename.c_str());
+
+#ifndef __WINDOWS_MM__
+	if (link(fromFilename.c_str(), toFilename.c_str()) == 0) return true;
+#endif
+
+	// copy under a temporary name so that no reader ever sees a partial file
+	stringstream ss;
+	ss << toFilename << ".tmp" << this_thread::get_id();
+	string temporaryFilename = ss.str();
+
+	if (!copyFile(fromFilename, temporaryFilename) || rename(temporaryFilename.c_str(), toFilename.c_str()) != 0)
 	{
-		int beatOfChordChange = chordChanges[chordChange];
-		
-		int beatOfChangingChord = beatOfChordChange - 1;
-		if (beatOfChangingChord < 0) beatOfChangingChord = numBeats-1; // last beat in song
+		remove(temporaryFilename.c_str());
+		return false;
+	}
 
-		if (beatOfChordChange != 0) // add all chord change notes except for chord change to beat 0 (first chord already added)
-		{
-			for (int channel = 0; channel < NUM_CHANNELS; channel++)
-			{
-				if (channel == BASS_NOTE_CHANNEL && !indicateBass) continue;
+	return true;
+}
 
-				// add chord notes
-				for (int noteIndex = 0; noteIndex < EMPTY_NOTE_STRING.size(); noteIndex++)
-				{
-					int noteBrightness = noteProgressionByChannel[channel][beatOfChordChange][noteIndex]-'0';
-					tickOffset = -2;
-					
-					addNoteMessage(channel, noteIndex, noteBrightness, (beatOfChordChange*TICKS_PER_QUARTER_NOTE)+tickOffset);
-				}
-			}
-		}
+void initializeRenderCache()
+{
+#ifdef __WINDOWS_MM__
+	mkdir(renderCacheDirectory.c_str());
+#else
+	mkdir(renderCacheDirectory.c_str(), 0755);
+#endif
+
+	// the configs are shared by every song, hash them once
+	uint64_t hash = getContentHash(&RENDER_CACHE_VERSION, sizeof(RENDER_CACHE_VERSION));
+	hash = getContentHash(chordMap, hash);
+	hash = getContentHash(scaleMap, hash);
+	renderCacheConfigHash = hash;
+}
 
-		if (beatOfChordChange != 0 || (beatOfChordChange == 0 && loopMode))
-		{
-			// add chord lead-in before chord change
-			for (int noteIndex = 0; noteIndex < EMPTY_NOTE_STRING.size(); noteIndex++)
-			{
-				int nextChordChannel;
-				if (chordChange % 2)
-				{
-					nextChordChannel = ODD_CHORD_CHANNEL;
-				}
-				else 
-				{
-					nextChordChannel = EVEN_CHORD_CHANNEL;
-				}
-				
-				if (noteProgression[beatOfChordChange][noteIndex] > '0')
-				{
-					tickOffset = -2;
-					
-					int channel;
+string getRenderCacheFilename(const string& inputContents)
+{
+	bool flags[] = { loopMode, brightMode, indicateBass, ignoreScales, runningStatus, compactFrames };
 
-					if (noteProgression[beatOfChangingChord][noteIndex] == '0')
-					{ // chord change adds new note
-						channel = nextChordChannel;
-					}
-					else if (noteProgression[beatOfChordChange][noteIndex] > noteProgression[beatOfChangingChord][noteIndex])
-					{ // chord change increases brightness of currently active note
-						// current note is the current root/bass note
-						if (indicateBass && noteProgressionByChannel[BASS_NOTE_CHANNEL][beatOfChangingChord][noteIndex] > '0')
-						{
-							channel =  BASS_NOTE_CHANNEL;
-						}
-						else
-						{
-							channel = MIXED_CHORD_CHANNEL;
-						}
-					}
-					else
-					{
-						continue;
-					}
+	uint64_t hash = getContentHash(flags, sizeof(flags), renderCacheConfigHash);
+	hash = getContentHash(channelPitchRanges, sizeof(channelPitchRanges), hash);
+	hash = getContentHash(inputContents.data(), inputContents.size(), hash);
+
+	stringstream ss;
+	ss << renderCacheDirectory << "/" << hex << setw(16) << setfill('0') << hash << ".mid";
+
+	return ss.str();
+}
 
-					// on beat
-					addNoteMessage(channel, noteIndex, noteProgression[beatOfChordChange][noteIndex]-'0', (beatOfChangingChord*TICKS_PER_QUARTER_NOTE)+tickOffset);
-					// off beat
-					addNoteMessage(channel, noteIndex, noteProgression[beatOfChangingChord][noteIndex]-'0', (beatOfChangingChord*TICKS_PER_QUARTER_NOTE)+(TICKS_PER_QUARTER_NOTE/2)+tickOffset);
-				}
-			}
-		}
-	
-		// update after writing each chord
-		tickOffset = 2;
-		addUpdateMessage((beatOfChordChange*TICKS_PER_QUARTER_NOTE)+tickOffset);
-		addUpdateMessage((beatOfChangingChord*TICKS_PER_QUARTER_NOTE)+tickOffset); // transistion on beat
-		addUpdateMessage((beatOfChangingChord*TICKS_PER_QUARTER_NOTE)+(TICKS_PER_QUARTER_NOTE/2)+tickOffset); // transistion off beat
-		
-	}
+// Renders a loaded song, or links its output from the render cache when an identical render was already done
+bool renderSongCached(Song& song, bool& cacheHit)
+{
+	cacheHit = false;
 
-	
-	// clear all notes after last beat in song
-	
-	for (int channel = 0; channel < NUM_CHANNELS; channel++)
+	string inputContents;
+	if (renderCacheDirectory.size() == 0 || song.outputFilename == STANDARD_OUTPUT_FILENAME || !readFileContents(song.inputFilename, inputContents))
+		return renderSong(song);
+
+	string cacheFilename = getRenderCacheFilename(inputContents);
+
+	struct stat cacheStat;
+	if (stat(cacheFilename.c_str(), &cacheStat) == 0 && linkOrCopyFile(cacheFilename, song.outputFilename))
 	{
-		for (int noteIndex = 0; noteIndex < EMPTY_NOTE_STRING.size(); noteIndex++)
-		{
-			int noteBrightness = noteProgressionByChannel[channel][numBeats-1][noteIndex] - '0';
-			if (noteBrightness > 0)
-			{
-				tickOffset = 0 - (channel * EMPTY_NOTE_STRING.size() + (noteIndex+1));
-				tickOffset = -2;
-				addNoteMessage(channel, noteIndex, 0, (numBeats*TICKS_PER_QUARTER_NOTE)+tickOffset);
-			}
-		}
-		
-		//tickOffset = channel;
-		//addUpdateMessage((numBeats*TICKS_PER_QUARTER_NOTE)+tickOffset, channel);
+		renderCacheHits++;
+		cacheHit = true;
+		return true;
 	}
-	
-	tickOffset = 0;
-	addUpdateMessage((numBeats*TICKS_PER_QUARTER_NOTE)+tickOffset);
-	
-	
-	// finalize and write output file
-	
-	midiOutputFile.sortTracks();
-	midiOutputFile.write(outputFilename);
-	
-	if (debugMode)
+
+	renderCacheMisses++;
+
+	if (!renderSong(song))
+		return false;
+
+	// renders that raised warnings are not reused
+	if (song.errorStatus == 0 && !linkOrCopyFile(song.outputFilename, cacheFilename))
 	{
-		midiOutputFile.writeBinascWithComments(BINASC_DIRECTORY + outputFilename + ".binasc");
+		cerr << "WARNING: Could not store '" << song.outputFilename << "' in render cache '" << renderCacheDirectory << "'" << endl;
 	}
+
+	return true;
 }
 
-void setNote(int channel, int note, int velocity)
+void displayRenderCacheStatistics()
 {
-	if (velocity > 0) // turning note on
+	if (renderCacheDirectory.size() == 0) return;
+
+	cout << "Render cache (" << renderCacheDirectory << "): " << renderCacheHits << " hits, " << renderCacheMisses << " misses." << endl;
+	cout << endl;
+}
+
+// Collects the input files of a batch: every .txt/.mma file in a directory, or one path per line of a list file
+vector<string> getBatchInputFiles(const string& batchFilename)
+{
+	vector<string> filenames;
+
+	DIR* directory = opendir(batchFilename.c_str());
+
+	if (directory != NULL)
 	{
-		activeNotes[channel].push_back(note);
-		if (damperActive[channel])
+		string path = batchFilename;
+		if (!endsWith(path, "/") && !endsWith(path, "\\")) path += "/";
+
+		struct dirent* entry;
+		while ((entry = readdir(directory)) != NULL)
 		{
-			activeNotes[channel].push_back(note);
-			damperNotes[channel].push_back(note);
+			string name = entry->d_name;
+			InputFileType fileType;
+			if (getInputFileType(name, fileType)) filenames.push_back(path + name);
 		}
+		closedir(directory);
+
+		sort(filenames.begin(), filenames.end());
+		return filenames;
 	}
-	
-	else if (velocity == 0) // turning note off
+
+	vector<string> lines = getLines(batchFilename);
+	for (int i = 0; i < lines.size(); i++)
 	{
-		if (!activeNotes[channel].empty())
-		{
-			for (int i = 0; i < activeNotes[channel].size(); i++)
-			{
-				if (activeNotes[channel][i] == note)
-				{
-					activeNotes[channel].erase(activeNotes[channel].begin()+i);
-				}
-			}
-		}
+		string line = lines[i];
+		if (line.size() == 0 || line[0] == '#') continue; // skip blank lines and comments
+		filenames.push_back(line);
 	}
-	
-	else
+
+	return filenames;
+}
+
+string getBatchOutputFilename(const string& filename, const string& outputDirectory)
+{
+	string outputFilename = getDefaultOutputFilename(filename);
+	if (outputDirectory.size() > 0) outputFilename = outputDirectory + "/" + outputFilename;
+	return outputFilename;
+}
+
+// Output names only keep the basename, so two inputs like 'a/x.txt' and 'b/x.mma' would be written to the same file
+bool checkBatchOutputFilenames(const vector<string>& filenames, const string& outputDirectory)
+{
+	map<string, string> inputByOutput;
+	bool unique = true;
+
+	for (int i = 0; i < filenames.size(); i++)
 	{
-		cerr << "WARNING: Invalid velocity for note " << note << " on channel " << channel << ". Note message ignored." << endl;
-		return;
+		string outputFilename = getBatchOutputFilename(filenames[i], outputDirectory);
+		map<string, string>::iterator existing = inputByOutput.find(outputFilename);
+
+		if (existing != inputByOutput.end())
+		{
+			cerr << "ERROR: Batch files '" << existing->second << "' and '" << filenames[i] << "' would both be written to '" << outputFilename << "'" << endl;
+			unique = false;
+			continue;
+		}
+
+		inputByOutput[outputFilename] = filenames[i];
 	}
+
+	return unique;
 }
 
-string getScale(string chordScale)
+// Loads and renders one song of a batch, returns its error status
+int renderBatchSong(const string& filename, const string& outputDirectory, int64_t& numBeats, int& numChordChanges, bool& cacheHit)
 {
-	if (!isValidNoteString(chordScale))
-	{
-		cerr << "INTERNAL ERROR: getScale('" << chordScale << "'): parameter is not valid note string. Ignoring..." << endl;
-		return EMPTY_NOTE_STRING;
-	}	
+	Song song;
+	song.inputFilename = filename;
+	song.outputFilename = getBatchOutputFilename(filename, outputDirectory);
 
-	string key = EMPTY_NOTE_STRING;
-	for (int i = 0; i < chordScale.size(); i++)
+	if (!getInputFileType(filename, song.inputFileType))
 	{
-		if (chordScale[i] == '1' || chordScale[i] == '2')
-			key[i] = '1';
+		cerr << "ERROR: Unsupported input file type: " << filename << endl;
+		return 1;
 	}
 
-	deque<string> scales = chordScaleMap[key];
-
-	if (chordScaleMap.find(key) == chordScaleMap.end() || scales.size() == 0)
+	if (loadInput(song) && renderSongCached(song, cacheHit))
 	{
-		if (debugMode) cerr << "WARNING - getScale('" << chordScale << "'): no scale found. Returning provided chord." << endl;
-		return chordScale;
+		numBeats = song.numBeats;
+		numChordChanges = song.chordChanges.size();
 	}
 
-	//string scale = scales.front();
+	return song.errorStatus;
+}
 
-	// pick random scale
-	int randomChoice = rand() % scales.size();
-	string scale = scales[randomChoice];
+// Renders every song of a batch on a pool of worker threads sharing the already loaded configs
+void renderBatch(const string& batchFilename, const string& outputDirectory)
+{
+	vector<string> filenames = getBatchInputFiles(batchFilename);
 
-	for (int i = 0; i < chordScale.size(); i++)
+	if (filenames.size() == 0)
 	{
-		if (chordScale[i] == '2')
-			scale[i] = '2';
+		cerr << "ERROR: No input files found in batch: " << batchFilename << endl;
+		errorStatus = 1;
+		return;
 	}
-	
-	if (debugMode)
-		cout << "INFO - getScale('" << chordScale << "'): returned '" << scale << "'" << endl;
 
-	return scale;
-}
+	if (!checkBatchOutputFilenames(filenames, outputDirectory))
+	{
+		errorStatus = 1;
+		return;
+	}
 
-void outputScale(string scale)
-{
-	for (int i = 0; i < scale.size(); i++)
+	atomic<int> nextSong(0);
+	atomic<int> numRendered(0);
+	atomic<int64_t> totalBeats(0);
+	mutex outputMutex;
+
+	chrono::steady_clock::time_point batchStart = chrono::steady_clock::now();
+
+	auto worker = [&]()
 	{
-		int channel = REALTIME_CHANNEL;
-		int intensity = scale[i] - '0';
-		
-		if (scale[i] == '3')
+		for (int i = nextSong++; i < (int)filenames.size(); i = nextSong++)
 		{
-			intensity = 2;
+			chrono::steady_clock::time_point songStart = chrono::steady_clock::now();
+
+			int64_t numBeats = 0;
+			int numChordChanges = 0;
+			bool cacheHit = false;
+			int status = renderBatchSong(filenames[i], outputDirectory, numBeats, numChordChanges, cacheHit);
+
+			double milliseconds = chrono::duration<double, milli>(chrono::steady_clock::now() - songStart).count();
+
+			lock_guard<mutex> lock(outputMutex);
 
-			if (indicateBass)
+			if (status == 0)
+			{
+				numRendered++;
+				totalBeats += numBeats;
+				if (cacheHit)
+					cout << "Cached '" << filenames[i] << "': " << numBeats << " beats, " << fixed << setprecision(2) << milliseconds << " ms" << endl;
+				else
+					cout << "Rendered '" << filenames[i] << "': " << numBeats << " beats, " << numChordChanges << " chord changes, " << fixed << setprecision(2) << milliseconds << " ms" << endl;
+			}
+			else
 			{
-				channel = REALTIME_BASS_NOTE_CHANNEL;
+				cout << "FAILED '" << filenames[i] << "': error status " << status << endl;
+				errorStatus = status;
 			}
 		}
+	};
 
-		addNoteMessage(channel, i, intensity, -1);
+	int numThreads = thread::hardware_concurrency();
+	if (numThreads < 1) numThreads = 1;
+	if (numThreads > filenames.size()) numThreads = filenames.size();
+
+	vector<thread> threads;
+	for (int t = 0; t < numThreads; t++)
+	{
+		threads.push_back(thread(worker));
+	}
+	for (int t = 0; t < numThreads; t++)
+	{
+		threads[t].join();
 	}
 
-	addUpdateMessage(-1);
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - batchStart).count();
+
+	cout << endl;
+	cout << "Batch complete: " << numRendered << "/" << filenames.size() << " files, " << totalBeats << " beats in " << fixed << setprecision(3) << seconds << " s";
+	if (seconds > 0)
+		cout << " (" << setprecision(1) << numRendered / seconds << " songs/sec, " << totalBeats / seconds << " beats/sec)";
+	cout << " using " << numThreads << " threads." << endl;
+	cout << endl;
+
+	displayRenderCacheStatistics();
+}
+
+#ifdef BENCHMARK
+// Benchmarks: times every stage of the pipeline on the sample charts and writes the results as JSON
+
+const string BENCHMARK_INPUT_DIRECTORY = "input/cps";
+const string BENCHMARK_OUTPUT_FILENAME = "bench.mid";
+const string BENCHMARK_MAPPING_FILENAME = "bench-chord-scale.cfg";
+const string LONG_SONG_CHECK_FILENAME = "bench-long.txt";
+
+const int CONFIG_BENCHMARK_ITERATIONS = 20;
+const int MAPPING_BENCHMARK_ITERATIONS = 5;
+const int SONG_BENCHMARK_ITERATIONS = 50;
+const int REALTIME_BENCHMARK_CYCLES = 20000;
+const int SCHEDULER_BENCHMARK_CYCLES = 200;
+const int SCHEDULER_BENCHMARK_CYCLE_MILLISECONDS = 2;
+const int64_t LONG_SONG_CHECK_BEATS = 10000000; // past where 32-bit ticks overflow
+
+atomic<uint64_t> benchmarkAllocations(0);
+atomic<uint64_t> benchmarkAllocatedBytes(0);
+
+// every allocation of the program goes through here in benchmark builds
+void* operator new(size_t size)
+{
+	benchmarkAllocations.fetch_add(1, memory_order_relaxed);
+	benchmarkAllocatedBytes.fetch_add(size, memory_order_relaxed);
+
+	void* memory = malloc(size ? size : 1);
+	if (memory == NULL) throw bad_alloc();
+	return memory;
+}
+
+void operator delete(void* memory) noexcept
+{
+	free(memory);
+}
+
+struct BenchmarkResult
+{
+	string name;
+	string eventName; // what one event is, eg. beats
+	int iterations;
+	double seconds; // time spent in the measured stage over all iterations
+	uint64_t allocations;
+	uint64_t allocatedBytes;
+	uint64_t events;
+
+	BenchmarkResult(const string& name, const string& eventName) : name(name), eventName(eventName), iterations(0), seconds(0), allocations(0), allocatedBytes(0), events(0) {}
+};
+
+struct BenchmarkMeasurement
+{
+	chrono::steady_clock::time_point start;
+	uint64_t allocations;
+	uint64_t allocatedBytes;
+};
+
+vector<BenchmarkResult> benchmarkResults;
+
+BenchmarkMeasurement startMeasurement()
+{
+	BenchmarkMeasurement measurement;
+	measurement.allocations = benchmarkAllocations;
+	measurement.allocatedBytes = benchmarkAllocatedBytes;
+	measurement.start = chrono::steady_clock::now();
+	return measurement;
+}
+
+void stopMeasurement(const BenchmarkMeasurement& measurement, BenchmarkResult& result, uint64_t events)
+{
+	result.seconds += chrono::duration<double>(chrono::steady_clock::now() - measurement.start).count();
+	result.allocations += benchmarkAllocations - measurement.allocations;
+	result.allocatedBytes += benchmarkAllocatedBytes - measurement.allocatedBytes;
+	result.events += events;
+	result.iterations++;
 }
 
-void setPriorityScale(string chord, string scale)
+void benchmarkLoadConfig()
 {
-	return;
-	if (debugMode) cout << "INFO - setPriorityScale('" << chord << "', '" << scale << "')" << endl;
+	BenchmarkResult result("loadConfig", "names");
 
-	if (!isValidNoteString(chord))
+	for (int i = 0; i < CONFIG_BENCHMARK_ITERATIONS; i++)
 	{
-		if (debugMode) cerr << "WARNING - setPriorityScale('" << chord << "', '" << scale << "'): parameter 1 is not a valid chord. Ignoring..." << endl;
-		return;
+		chordMap.clear();
+		scaleMap.clear();
+		reverseChordMap.clear();
+		reverseScaleMap.clear();
+
+		BenchmarkMeasurement measurement = startMeasurement();
+		loadConfig();
+		stopMeasurement(measurement, result, chordMap.size() + scaleMap.size());
 	}
 
-	if (!isValidNoteString(scale))
-	{
-		if (debugMode) cerr << "WARNING - setPriorityScale('" << chord << "', '" << scale << "'): parameter 2 is not a valid scale. Ignoring..." << endl;
-		return;
-	}	
+	benchmarkResults.push_back(result);
+}
+
+void benchmarkChordScaleMapping()
+{
+	BenchmarkResult generateResult("generateChordScaleMapping", "scales");
 
-	string normalizedChord = EMPTY_NOTE_STRING;
-	for (int i = 0; i < chord.size(); i++)
+	for (int i = 0; i < MAPPING_BENCHMARK_ITERATIONS; i++)
 	{
-		if (chord[i] == '2')
-			normalizedChord[i] = '1';
+		BenchmarkMeasurement measurement = startMeasurement();
+		generateChordScaleMapping(BENCHMARK_MAPPING_FILENAME);
+		stopMeasurement(measurement, generateResult, numChordScaleMasks);
 	}
 
-	string normalizedScale = EMPTY_NOTE_STRING;
-	for (int i = 0; i < scale.size(); i++)
+	remove(BENCHMARK_MAPPING_FILENAME.c_str());
+	benchmarkResults.push_back(generateResult);
+
+	// the mapping file may not exist yet, and the other benchmarks use it
+	loadOrGenerateChordScaleMapping(chordScaleMappingFilename);
+
+	BenchmarkResult loadResult("loadChordScaleMapping", "scales");
+
+	for (int i = 0; i < MAPPING_BENCHMARK_ITERATIONS; i++)
 	{
-		if (scale[i] == '1' || scale[i] == '2')
-			normalizedScale[i] = '1';
+		BenchmarkMeasurement measurement = startMeasurement();
+		loadChordScaleMapping(chordScaleMappingFilename);
+		stopMeasurement(measurement, loadResult, numChordScaleMasks);
 	}
 
-	if (chordScaleMap.find(normalizedChord) == chordScaleMap.end())
+	benchmarkResults.push_back(loadResult);
+}
+
+// Runs the song stages up to the measured one, false if the song can't be rendered
+bool prepareBenchmarkSong(Song& song, const string& filename, int numStages)
+{
+	song.inputFilename = filename;
+	song.outputFilename = BENCHMARK_OUTPUT_FILENAME;
+	song.inputFileType = TXT;
+
+	if (numStages > 0 && !loadInput(song)) return false;
+	if (numStages > 1 && !generateNoteProgression(song)) return false;
+	if (numStages > 2) separateNoteProgressionByChannel(song);
+
+	return true;
+}
+
+void benchmarkSongs()
+{
+	vector<string> filenames;
+	vector<string> inputFiles = getBatchInputFiles(BENCHMARK_INPUT_DIRECTORY);
+
+	// only charts that render take part, so every stage measures the same songs
+	for (int i = 0; i < inputFiles.size(); i++)
 	{
-		if (debugMode) cerr << "WARNING - setPriorityScale('" << chord << "', '" << scale << "'): normalized chord '" << normalizedChord << "' not found. Ignoring..." << endl;
-		return;
+		Song song;
+		if (endsWith(inputFiles[i], ".txt") && prepareBenchmarkSong(song, inputFiles[i], 3)) filenames.push_back(inputFiles[i]);
 	}
-	deque<string> scales = chordScaleMap[normalizedChord];
-	
-	for (unsigned int i = 0; i < scales.size(); i++)
+
+	if (filenames.size() == 0)
 	{
-		if (scales[i] == normalizedScale)
-		{
-			scales.erase(scales.begin()+i);
-			break;
-		}
+		cerr << "ERROR: No sample charts could be rendered from: " << BENCHMARK_INPUT_DIRECTORY << endl;
+		errorStatus = 1;
+		return;
 	}
 
-	scales.push_front(normalizedScale);
-	chordScaleMap[normalizedChord] = scales;
-}
+	BenchmarkResult stageResults[] =
+	{
+		BenchmarkResult("loadCPSfile", "beats"),
+		BenchmarkResult("generateNoteProgression", "beats"),
+		BenchmarkResult("separateNoteProgressionByChannel", "beats"),
+		BenchmarkResult("createMidiFile", "beats")
+	};
 
-void activateRealtime(bool enable, int channel)
-{
-	if (enable)
+	for (int stage = 0; stage < 4; stage++)
 	{
-		for (int i = 0; i < activeNotes[channel].size(); i++)
+		for (int i = 0; i < SONG_BENCHMARK_ITERATIONS; i++)
 		{
-			int activeNote = activeNotes[channel][i];
-			int noteIndex = activeNote % 12;
-			if (activeChordScale[noteIndex] == '0')
+			for (int f = 0; f < filenames.size(); f++)
 			{
-				int intensity = 0;
-				if (realtimeActive[channel])
-					intensity = 1;
-				else
-					intensity = 2;
+				Song song;
+				prepareBenchmarkSong(song, filenames[f], stage);
 
-				activeChordScale[noteIndex] = '0' + intensity;
-			}
-		}
+				BenchmarkMeasurement measurement = startMeasurement();
 
-		string suggestedScale = getScale(activeChordScale);
+				if (stage == 0) loadCPSfile(song);
+				else if (stage == 1) generateNoteProgression(song);
+				else if (stage == 2) separateNoteProgressionByChannel(song);
+				else createMidiFile(song);
 
-		if (EMPTY_NOTE_STRING.compare(suggestedScale) != 0 && activeSuggestedScale.compare(suggestedScale) != 0)
-		{
-			if (realtimeActive[channel])
-			{
-				setPriorityScale(activeChordScale, suggestedScale);
-				outputScale(EMPTY_NOTE_STRING);
+				stopMeasurement(measurement, stageResults[stage], song.numTicks / TICKS_PER_QUARTER_NOTE);
 			}
-
-			activeSuggestedScale = suggestedScale;	
-			outputScale(suggestedScale);
 		}
 
-		realtimeActive[channel] = true;
+		benchmarkResults.push_back(stageResults[stage]);
 	}
-	else
-	{
-		realtimeActive[channel] = false;
-		activeChordScale = EMPTY_NOTE_STRING;
-		activeSuggestedScale = EMPTY_NOTE_STRING;
 
-		outputScale(EMPTY_NOTE_STRING);
-	}
+	remove(BENCHMARK_OUTPUT_FILENAME.c_str());
 }
 
-void handleActivateRealtimeMessage(bool enable, int channel)
+// The next byte of a track chunk, -1 at its end
+int readChunkByte(istream& in, uint32_t& remaining)
 {
-	if (enable)
-	{
-		if (realtimeActive[channel])
-		{
-			if (debugMode) std::cerr << "WARNING: Received realtime ON request, but realtime is already active. Ignoring request." << std::endl;
-			return;	
-		}
-	}
-	else
+	if (remaining == 0) return -1;
+	remaining--;
+	return in.get();
+}
+
+bool readChunkVariableLengthValue(istream& in, uint32_t& remaining, uint64_t& value)
+{
+	value = 0;
+	int byte;
+
+	do
 	{
-		if (!realtimeActive[channel])
-		{
-			if (debugMode) std::cerr << "WARNING: Received realtime OFF request, but realtime is not currently active. Ignoring request." << std::endl;
-			return;
-		}
+		byte = readChunkByte(in, remaining);
+		if (byte < 0) return false;
+		value = (value << 7) | (byte & 0x7F);
 	}
+	while (byte & 0x80);
 
-	activateRealtime(enable, channel);
+	return true;
 }
 
-void handleDamperMessage(bool enable, int channel)
+// Follows the delta times of every track of a written file, false if a track runs past the end of the song or none reaches it
+bool ticksStayInSong(const string& filename, int64_t numTicks)
 {
-	if (enable)
-	{
-		if (damperActive[channel])
-		{
-			if (debugMode) cerr << "WARNING: Received damper ON request, but damper is already active. Ignoring request." << endl;
-			return;
-		}
+	ifstream in(filename.c_str(), ios::binary);
+	in.ignore(14); // header chunk
 
-		damperActive[channel] = true;
+	bool reachedEnd = false;
 
-		unsigned int size = activeNotes[channel].size();
-		for (int i = 0; i < size; i++)
-		{
-			int activeNote = activeNotes[channel][i];
-			activeNotes[channel].push_back(activeNote);
-			damperNotes[channel].push_back(activeNote);
-		}
-	}
-	else
+	for (int track = 0; track < NUM_CHANNELS; track++)
 	{
-		if (!damperActive[channel])
-		{
-			if (debugMode) cerr << "WARNING: Received damper OFF request, but damper is not currently active. Ignoring request." << endl;
-			return;
-		}
+		unsigned char chunkHeader[8];
+		in.read((char*)chunkHeader, sizeof(chunkHeader));
+		if (!in || memcmp(chunkHeader, "MTrk", 4) != 0) return false;
 
-		damperActive[channel] = false;
+		uint32_t remaining = ((uint32_t)chunkHeader[4] << 24) | (chunkHeader[5] << 16) | (chunkHeader[6] << 8) | chunkHeader[7];
+		int64_t tick = 0;
+		int status = 0;
+		uint64_t delta;
 
-		// Turn all damper notes off
-		for (int i = 0; i < damperNotes[channel].size(); i++)
+		while (readChunkVariableLengthValue(in, remaining, delta))
 		{
-			int activeNote = damperNotes[channel][i];
-			setNote(channel, activeNote, 0); // turn note off
-		}	
+			tick += delta;
+			if (tick > numTicks) return false; // a wrapped tick shows up as a jump past the end
 
-		damperNotes[channel].clear();
-	}
-}
+			int byte = readChunkByte(in, remaining);
+			uint64_t length;
 
-void handleSostenutoMessage(bool enable, int channel)
-{
-	if (enable)
-	{
-		if (sostenutoActive[channel])
-		{
-			if (debugMode) cerr << "WARNING: Received sostenuto ON request, but sostenuto is already active. Ignoring request." << endl;
-			return;
-		}
+			if (byte < 0) return false;
+			else if (byte == 0xFF) // meta message: type, length, data
+			{
+				if (readChunkByte(in, remaining) < 0 || !readChunkVariableLengthValue(in, remaining, length)) return false;
+			}
+			else if (byte == 0xF0) // system exclusive: length, data
+			{
+				if (!readChunkVariableLengthValue(in, remaining, length)) return false;
+			}
+			else
+			{
+				bool runningStatus = !(byte & 0x80); // the byte was already data
+				if (!runningStatus) status = byte;
 
-		sostenutoActive[channel] = true;
+				int command = status & 0xF0;
+				length = (command == 0xC0 || command == 0xD0 ? 1 : 2) - (runningStatus ? 1 : 0);
+			}
 
-		unsigned int size = activeNotes[channel].size();
-		for (int i = 0; i < size; i++)
-		{
-			int activeNote = activeNotes[channel][i];
-			activeNotes[channel].push_back(activeNote);
-			sostenutoNotes[channel].push_back(activeNote);
+			if (length > remaining) return false;
+			in.ignore(length);
+			remaining -= length;
 		}
+
+		if (!in || remaining != 0) return false;
+		if (tick == numTicks) reachedEnd = true;
 	}
-	else
-	{
-		if (!sostenutoActive[channel])
-		{
-			if (debugMode) cerr << "WARNING: Received sostenuto OFF request, but sostenuto is not currently active. Ignoring request." << endl;
-			return;
-		}
 
-		sostenutoActive[channel] = false;
+	return reachedEnd;
+}
 
-		// Turn all sostenuto notes off
-		for (int i = 0; i < sostenutoNotes[channel].size(); i++)
-		{
-			int activeNote = sostenutoNotes[channel][i];
-			setNote(channel, activeNote, 0); // turn note off
-		}	
+// Generates a song longer than 32-bit ticks can hold and checks that it renders with its ticks in order
+void checkLongSongTicks()
+{
+	int64_t beats = generatedBeats;
+	generatedBeats = LONG_SONG_CHECK_BEATS;
+	generateProgressionFile(LONG_SONG_CHECK_FILENAME);
+	generatedBeats = beats;
+
+	Song song;
+	bool rendered = prepareBenchmarkSong(song, LONG_SONG_CHECK_FILENAME, 3);
+	if (rendered)
+	{
+		createMidiFile(song);
+		rendered = song.errorStatus == 0;
+	}
 
-		sostenutoNotes[channel].clear();
+	if (!rendered || !ticksStayInSong(BENCHMARK_OUTPUT_FILENAME, song.numTicks))
+	{
+		cerr << "ERROR: Long song check failed: " << LONG_SONG_CHECK_BEATS << " generated beats do not render with their ticks in order" << endl;
+		errorStatus = 1;
 	}
+
+	remove(LONG_SONG_CHECK_FILENAME.c_str());
+	remove(BENCHMARK_OUTPUT_FILENAME.c_str());
 }
 
-void onMidiMessageReceived(double deltatime, std::vector<unsigned char>* message, void* userData)
+// Applies one CC message the way the engine thread would
+void processControlChange(int ccCode, int value)
 {
-	lastMidiMessageReceived->clear();
-	for (unsigned int i = 0; i < message->size(); i++)
-	{
-		lastMidiMessageReceived->push_back(message->at(i));
-	}
+	MidiInputEvent event;
+	event.bytes[0] = ccStatusCodeMin;
+	event.bytes[1] = ccCode;
+	event.bytes[2] = value;
+	event.size = 3;
+	event.timestamp = 0;
+	event.receivedNanoseconds = monotonicNanoseconds();
+	processMidiEvent(event);
+}
 
-	int code = (int) message->at(0);
+// Checks that pedal messages leave realtime mode alone, in either state
+void checkPedalsKeepRealtime()
+{
+	const int pedalCodes[] = { cc_damper, cc_sostenuto };
+	bool kept = true;
 
-	if (code >= noteOnCodeMin && code <= noteOnCodeMax)
+	for (int active = 0; active < 2; active++)
 	{
-		int channel = code - noteOnCodeMin;
-		setNote(channel, message->at(1), message->at(2));
+		if (active) processControlChange(cc_activate_realtime, 127);
 
-		if (message->at(2) > 0 && realtimeMode && realtimeActive[channel])
+		for (int p = 0; p < 2; p++)
 		{
-			//activateRealtime(true, channel);
+			processControlChange(pedalCodes[p], 127);
+			if (realtimeActive[0] != (active == 1)) kept = false;
+			processControlChange(pedalCodes[p], 0);
+			if (realtimeActive[0] != (active == 1)) kept = false;
 		}
-	}	
-	else if (code >= noteOffCodeMin && code <= noteOffCodeMax)
-	{
-		int channel = code - noteOffCodeMin;
-		setNote(channel, message->at(1), 0);
 	}
-	else if (code >= ccStatusCodeMin && code <= ccStatusCodeMax)
-	{
-		int ccCode = (int) message->at(1);
-		int value = (int) message->at(2);
-		int channel = code - (int) ccStatusCodeMin;
 
-		if (ccCode == cc_sostenuto)
-		{
-			handleSostenutoMessage(value > 0, channel);
-		}
-		else if (ccCode == cc_damper)
-		{
-			handleDamperMessage(value > 0, channel);
-		}
+	processControlChange(cc_activate_realtime, 0);
 
-		if (ccCode = cc_activate_realtime)
-		{
-			handleActivateRealtimeMessage(value > 0, channel);
-		}
+	if (!kept)
+	{
+		cerr << "ERROR: Realtime check failed: a pedal message toggled realtime mode" << endl;
+		errorStatus = 1;
 	}
 }
 
-void initializeRtMidi()
+// Sends one cycle of chord presses through the RtMidi callback, returns the number of messages
+int feedRealtimeCycle(int cycle, vector<unsigned char>& message)
 {
-	damperActive = new bool[numChannels];
-	sostenutoActive = new bool[numChannels];
-	realtimeActive = new bool[numChannels];
+	int root = 48 + cycle % NOTES_PER_OCTAVE;
 
-	for (int i = 0; i < numChannels; i++)
+	// major triad down, realtime on and off, triad up
+	const unsigned char messages[][3] =
 	{
-		damperActive[i] = false;
-		sostenutoActive[i] = false;
-		realtimeActive[i] = false;
+		{ noteOnCodeMin, (unsigned char)root, 100 },
+		{ noteOnCodeMin, (unsigned char)(root + 4), 100 },
+		{ noteOnCodeMin, (unsigned char)(root + 7), 100 },
+		{ ccStatusCodeMin, cc_activate_realtime, 127 },
+		{ ccStatusCodeMin, cc_activate_realtime, 0 },
+		{ noteOffCodeMin, (unsigned char)root, 0 },
+		{ noteOffCodeMin, (unsigned char)(root + 4), 0 },
+		{ noteOffCodeMin, (unsigned char)(root + 7), 0 }
+	};
+	int numMessages = sizeof(messages) / sizeof(messages[0]);
+
+	for (int m = 0; m < numMessages; m++)
+	{
+		// never overflow the queue, the engine is what's being measured
+		while (midiEventQueueHead - midiEventQueueTail >= MIDI_EVENT_QUEUE_SIZE) this_thread::yield();
+
+		message.assign(messages[m], messages[m] + 3);
+		onMidiMessageReceived(0, &message, NULL);
 	}
 
-	midiIn = new RtMidiIn(RtMidi::Api::UNSPECIFIED, DEFAULT_RTMIDI_IN_NAME, 100);
-	midiIn->openVirtualPort();
-	midiIn->setCallback( &onMidiMessageReceived );
-	midiIn->ignoreTypes( true, true, true );
+	return numMessages;
+}
+
+// Feeds chord presses through the RtMidi callback and waits for the engine thread to send the LEDs
+void benchmarkRealtime()
+{
+	initializeRealtimeState();
 
 	midiOut = new RtMidiOut(RtMidi::Api::UNSPECIFIED, DEFAULT_RTMIDI_OUT_NAME);
 	midiOut->openVirtualPort();
 
-	lastMidiMessageReceived = new std::vector<unsigned char>();
+	startRealtimeEngine();
 
-	// Connect ALSA Ports
-	if (autoConnectALSAPorts)
+	BenchmarkResult result("realtime", "messages");
+	vector<unsigned char> message(3);
+	uint64_t numMessages = 0;
+
+	BenchmarkMeasurement measurement = startMeasurement();
+
+	for (int cycle = 0; cycle < REALTIME_BENCHMARK_CYCLES; cycle++)
 	{
-		string command1 = "aconnect \"" + DEFAULT_ALSA_INPUT_NAME_1 + "\" \"" + DEFAULT_ALSA_OUTPUT_NAME_1 + "\"";
-		string command2 = "aconnect \"" + DEFAULT_ALSA_INPUT_NAME_2 + "\" \"" + DEFAULT_ALSA_OUTPUT_NAME_2 + "\"";		
-		
-		system(command1.c_str());
-		system(command2.c_str());
+		numMessages += feedRealtimeCycle(cycle, message);
 	}
-}
 
-void initialize(int argc, char** argv)
-{
-	// Initialize variables
-	errorStatus = 0;
-	realtimeMode = false;
-	brightMode = false;
-	indicateBass = false;
-	loopMode = true;
-	debugMode = false;
-	ignoreScales = false;
-	
-	chordScaleMappingFilename = "";
-	inputFilename = "";
-	outputFilename = "";
+	while (midiEventQueueTail != midiEventQueueHead) this_thread::yield();
 
-	activeChordScale = EMPTY_NOTE_STRING;
-	activeSuggestedScale = EMPTY_NOTE_STRING;
+	stopMeasurement(measurement, result, numMessages);
+	benchmarkResults.push_back(result);
 
-	loadConfig();
-	
-	// Process command line options
-	parseArgs(argc, argv);
-	
-	for (int i = 1; i < getArgCount(); i++)
-	{
-		if (processOption(i))
-			i++;
-	}
+	stopRealtimeEngine();
 
-	if (getArgCount() == 1)
-		realtimeMode = true;
+	checkPedalsKeepRealtime();
+}
 
-	if (realtimeMode)
-	{
-		initializeRtMidi();
+// Simulated MIDI link for the output scheduler: takes the output in place of midiOut, checks its pace and tracks the LEDs
+const int SIMULATED_LINK_BUFFER_SIZE = MAX_NOTE_MESSAGES * NOTE_MESSAGE_SIZE; // the largest change is handed over at once
 
-		if (chordScaleMappingFilename.size() == 0)
-		{
-			chordScaleMappingFilename = DEFAULT_CHORD_SCALE_MAPPING_FILENAME;
-		}
+int64_t simulatedLinkReceived; // when the last message arrived
+double simulatedLinkBacklog; // bytes not yet on the wire
+uint64_t simulatedLinkOverruns; // messages that arrived with the buffer full
+NoteSet simulatedLinkFrames[NUM_OUTPUT_CHANNELS];
 
-		ifstream f(chordScaleMappingFilename.c_str());
-		bool fileExists = f.good();
-		f.close();
+void receiveOnSimulatedLink(const unsigned char* message, size_t size)
+{
+	int64_t now = monotonicNanoseconds();
+	double bytesPerNanosecond = (double)linkBaudRate / BITS_PER_MIDI_BYTE / 1000000000;
 
-		if (fileExists)
-		{
-			loadChordScaleMapping(chordScaleMappingFilename);
-		}
-		
-		else
-		{
-			generateChordScaleMapping(chordScaleMappingFilename);
-		}	
+	simulatedLinkBacklog = max(0.0, simulatedLinkBacklog - (now - simulatedLinkReceived) * bytesPerNanosecond) + size;
+	simulatedLinkReceived = now;
+	if (simulatedLinkBacklog > SIMULATED_LINK_BUFFER_SIZE) simulatedLinkOverruns++;
 
-		cout << endl << "Realtime mode active." << endl << endl;
+	int channel;
+	uint8_t brightness[NOTES_PER_OCTAVE];
 
-		return;
-	}
-	
-	if (inputFilename.size() == 0)
-	{
-		cerr << "Please specify either an input file (-i) or realtime mode (-t)." << endl;
-		errorStatus = 1;
-		end(errorStatus);
-	}
-	
-	if (outputFilename.size() == 0)
+	if (size == FRAME_MESSAGE_SIZE && decodeFrameMessage(message, channel, brightness))
 	{
-		int indexOfLastSlash = -1;
-		int indexOfLastPeriod = -1;
-		for (int i = 0; i < inputFilename.size(); i++)
+		for (int noteIndex = 0; noteIndex < NOTES_PER_OCTAVE; noteIndex++)
 		{
-			if (inputFilename[i] == '/' || inputFilename[i] == '\\') indexOfLastSlash = i;
-			if (inputFilename[i] == '.') indexOfLastPeriod = i;
+			simulatedLinkFrames[channel].setBrightness(noteIndex, brightness[noteIndex]);
 		}
-		outputFilename = inputFilename.substr(indexOfLastSlash+1,indexOfLastPeriod-indexOfLastSlash-1) + "_CPV.mid";
 	}
-	
-	loadInput(inputFilename);
-
-	numBeats = chordProgression.size();
-	
-	if (numBeats == 0)
+	else if (size == NOTE_MESSAGE_SIZE && message[0] >= noteOffCodeMin && message[0] <= noteOnCodeMax)
 	{
-		cerr << "No chords found in input file. Exiting..." << endl;
-		errorStatus = 2;
-		end(errorStatus);
-	}	
+		channel = (message[0] & 0x0F) - STARTING_CHANNEL;
+		int velocity = message[0] >= noteOnCodeMin ? message[2] : 0;
+		simulatedLinkFrames[channel].setBrightness(message[1] % NOTES_PER_OCTAVE, getVelocityBrightness(velocity));
+	}
 }
 
-void displaySettings()
+// Feeds chord presses faster than a DIN link can show them, then checks the scheduler kept to the link and ended on the last frame
+void benchmarkOutputScheduler()
 {
-	cout << endl << "Settings: " << endl;
+	initializeRealtimeState();
 
-	cout << "Loop mode (enabled by default): " << boolToText(loopMode) << endl;
-	cout << "Indicate bass (disabled by default): " << boolToText(indicateBass) << endl;
-	cout << "Bright mode (disabled by default): " << boolToText(brightMode) << endl;
-	cout << "Chords only (disabled by default): " << boolToText(ignoreScales) << endl;
-	
-	cout << endl;
-}
-
-void displayChordScaleMapping()
-{
-	cout << "Chord Scale Mapping (" << chordScaleMappingFilename << "): " << endl;
-	cout << getChordScaleMappingString();
-	cout << endl;
-}
+	scheduleOutput = true;
+	outputSink = receiveOnSimulatedLink;
 
-void displayChordMapping()
-{
-	cout << "Chord Types: " << endl;
-	for (map<string, string>::const_iterator it = chordMap.begin(); it != chordMap.end(); it++)
+	simulatedLinkReceived = monotonicNanoseconds();
+	simulatedLinkBacklog = 0;
+	simulatedLinkOverruns = 0;
+	for (int channel = 0; channel < NUM_OUTPUT_CHANNELS; channel++)
 	{
-		cout << it->first << "   :   " << it->second << endl;
-	}	
-	cout << endl;
-}
+		simulatedLinkFrames[channel] = emittedFrames[channel];
+	}
 
-void displayScaleMapping()
-{
-	cout << "Scale Types: " << endl;
-	for (map<string, string>::const_iterator it = scaleMap.begin(); it != scaleMap.end(); it++)
+	startRealtimeEngine();
+
+	BenchmarkResult result("outputScheduler", "messages");
+	vector<unsigned char> message(3);
+	uint64_t numMessages = 0;
+
+	BenchmarkMeasurement measurement = startMeasurement();
+
+	for (int cycle = 0; cycle < SCHEDULER_BENCHMARK_CYCLES; cycle++)
 	{
-		cout << it->first << "   :   " << it->second << endl;
-	}	
-	cout << endl;
-}
+		numMessages += feedRealtimeCycle(cycle, message);
+		this_thread::sleep_for(chrono::milliseconds(SCHEDULER_BENCHMARK_CYCLE_MILLISECONDS)); // a fast player, still faster than the link
+	}
 
-void realtimeLoop()
-{
-	char input;
-	while (cin.get(input))
+	while (midiEventQueueTail != midiEventQueueHead) this_thread::yield();
+
+	stopRealtimeEngine(); // drains the scheduler
+
+	stopMeasurement(measurement, result, numMessages);
+	benchmarkResults.push_back(result);
+
+	displayOutputSchedulerStatistics();
+
+	bool framesMatch = true;
+	for (int channel = 0; channel < NUM_OUTPUT_CHANNELS; channel++)
 	{
+		if (simulatedLinkFrames[channel] != scheduledFrames[channel]) framesMatch = false;
+	}
 
+	if (simulatedLinkOverruns > 0 || !framesMatch)
+	{
+		cerr << "ERROR: Output scheduler check failed: " << simulatedLinkOverruns << " link overruns, the LEDs " << (framesMatch ? "show" : "do not show") << " the last frame" << endl;
+		errorStatus = 1;
 	}
-	cin.clear();
-	cout << endl << "Received EOF." << endl;
+
+	scheduleOutput = false;
+	outputSink = NULL;
 }
 
-string getFormattedTimestamp()
+void writeBenchmarkResults(ostream& out)
 {
-	time_t rawtime;
-	struct tm * timeinfo;
-	char buffer[80];
+	out << "{" << endl << "\t\"benchmarks\": [" << endl;
 
-	time (&rawtime);
-	timeinfo = localtime(&rawtime);
-	
-	strftime(buffer,sizeof(buffer),"%m-%d-%Y_%I:%M:%S",timeinfo);
-	string str(buffer);
+	for (int i = 0; i < benchmarkResults.size(); i++)
+	{
+		const BenchmarkResult& result = benchmarkResults[i];
+		double eventsPerSecond = result.seconds > 0 ? result.events / result.seconds : 0;
+
+		out << "\t\t{ \"name\": \"" << result.name << "\""
+			<< ", \"iterations\": " << result.iterations
+			<< ", \"seconds\": " << setprecision(9) << result.seconds
+			<< ", \"secondsPerIteration\": " << result.seconds / result.iterations
+			<< ", \"allocations\": " << result.allocations
+			<< ", \"allocatedBytes\": " << result.allocatedBytes
+			<< ", \"events\": " << result.events
+			<< ", \"eventName\": \"" << result.eventName << "\""
+			<< ", \"eventsPerSecond\": " << setprecision(6) << eventsPerSecond << " }"
+			<< (i + 1 < benchmarkResults.size() ? "," : "") << endl;
+	}
 
-	return str;
+	out << "\t]" << endl << "}" << endl;
 }
 
-void wouldYouLikeToSave()
+void runBenchmarks()
 {
-	cout << "Would you like to save changes to chord-scale priority?" << endl;
-	cout << "1) Yes" << endl;
-	cout << "2) No" << endl;
-	cout << "Please enter a number: ";
-
-	int input;
-	cin >> input;
-	cout << endl;
-
-	if (input == 1)
+	benchmarkLoadConfig();
+	benchmarkChordScaleMapping();
+	benchmarkSongs();
+	checkLongSongTicks();
+	benchmarkRealtime();
+	benchmarkOutputScheduler();
+
+	if (benchmarkFilename.size() == 0)
 	{
-		cout << "Would you like to create a new file or overwrite '" << chordScaleMappingFilename << "'?" << endl;
-		cout << "1) Save to new file" << endl;
-		cout << "2) Overwrite" << endl;
-		cout << "Please enter a number: ";
-
-		cin >> input;
-		cout << endl;
-
-		string fileToSaveTo = "";
+		writeBenchmarkResults(cout);
+		return;
+	}
 
-		if (input == 2)
-		{
-			fileToSaveTo = chordScaleMappingFilename;
-		}
-		else
-		{
-			fileToSaveTo = chordScaleMappingFilename.substr(0, chordScaleMappingFilename.find_last_of(".")) + "[" + getFormattedTimestamp() + "]" + chordScaleMappingFilename.substr(chordScaleMappingFilename.find_last_of("."), chordScaleMappingFilename.size());
-		}
+	ofstream benchmarkFile(benchmarkFilename.c_str());
+	writeBenchmarkResults(benchmarkFile);
+	benchmarkFile.close();
 
-		writeChordScaleMapping(fileToSaveTo);
-		cout << "Changes have been saved to '" << fileToSaveTo << "'." << endl;
-	}
-	else
+	if (!benchmarkFile)
 	{
-		cout << "Changes will not be saved." << endl;
+		cerr << "ERROR: Could not write benchmark results: " << benchmarkFilename << endl;
+		errorStatus = 2;
+		return;
 	}
+
+	cout << "Benchmark results written to '" << benchmarkFilename << "'." << endl;
 }
+#endif
 
 int main(int argc, char** argv) 
 {	
 	initialize(argc, argv);
 
+#ifdef BENCHMARK
+	if (benchmarkMode)
+	{
+		runBenchmarks();
+		end(errorStatus);
+	}
+#endif
+
 	if (debugMode)
 	{
 		displayChordMapping();
@@ -2198,6 +6009,8 @@ int main(int argc, char** argv)
 
 		cout << endl;
 
+		displayRealtimeEngineStatistics();
+
 		//wouldYouLikeToSave();
 
 		cout << endl;
@@ -2205,67 +6018,59 @@ int main(int argc, char** argv)
 		end(errorStatus);
 	}
 
+	if (renderCacheDirectory.size() > 0)
+	{
+		initializeRenderCache();
+	}
+
+	if (batchFilename.size() > 0)
+	{
+		displaySettings();
+		renderBatch(batchFilename, outputFilename);
+		end(errorStatus);
+	}
+
 	// else continue to standard chord progression mode
 
-	displaySettings();
-	
-	if (debugMode)
+	Song song;
+	song.inputFilename = inputFilename;
+	song.outputFilename = outputFilename;
+	song.inputFileType = inputFileType;
+
+	if (!loadInput(song))
 	{
-		cout << "BPM: " << beatsPerMinute << endl;
-		cout << endl;
-		
-		cout << "Number of Beats: " << numBeats << endl;
-		cout << endl;
-	
-		cout << "Chord Progression: " << endl;
-		for (int i = 0; i < chordProgression.size(); i++)
-			cout << "[" << i << "]: " << chordProgression[i] << " | Root: " << getRoot(chordProgression[i]) << " | Bass: " << getBass(chordProgression[i]) << " | Type: " << getChordType(chordProgression[i]) << endl;
-		cout << endl;
-	
-		cout << "Scale Progression: " << endl;
-		for (int i = 0; i < scaleProgression.size(); i++)
-			cout << "[" << i << "]: " << scaleProgression[i] << " | Root: " << getRoot(scaleProgression[i]) << " | Bass: " << getBass(scaleProgression[i]) << " | Type: " << getChordType(scaleProgression[i]) << endl;
-		cout << endl;
+		cerr << "Exiting..." << endl;
+		end(song.errorStatus);
 	}
 
-	generateNoteProgression();
-	
-	if (debugMode)
+	displaySettings();
+
+	if (playMode)
 	{
-		cout << "Note Progression: " << endl;
-		for (int i = 0; i < noteProgression.size(); i++)
-			cout << "[" << i << "]: " << noteProgression[i] << endl;	
-		cout << endl;
+		playSong(song);
+		end(song.errorStatus);
 	}
-		
-	separateNoteProgressionByChannel();
 	
-	if (debugMode)
+	bool cacheHit;
+	if (!renderSongCached(song, cacheHit))
 	{
-		cout << "Note Progression by Channel: " << endl;
-		for (int i = 0; i < NUM_CHANNELS; i++)
-		{
-			for (int j = 0; j < noteProgressionByChannel[i].size(); j++)
-			{
-				cout << "[" << i << "][" << j << "]: " << noteProgressionByChannel[i][j] << endl;
-			}
-		}
-		cout << endl;
-		
-		cout << "Chord changes: " << endl;
-		for (int i = 0; i < chordChanges.size(); i++)
-			cout << "[" << i << "]: " << "Beat #" << chordChanges[i] << endl;
-		cout << endl;
+		end(song.errorStatus);
 	}
-	
-	createMidiFile();
 
-	if (errorStatus == 0)
+	if (song.errorStatus == 0)
 	{
 		cout << endl;
-		cout << "Output file '" << outputFilename << "' successfully written." << endl;
+		cout << "Output file '" << song.outputFilename << "' successfully written" << (cacheHit ? " from the render cache." : ".") << endl;
+		if (!cacheHit) cout << "Redundant MIDI events removed: " << song.numRedundantEvents << endl;
+		if (!cacheHit && runningStatus)
+		{
+			uint64_t fullSize = song.outputFileSize + song.numRunningStatusBytes;
+			cout << "Running status saved " << song.numRunningStatusBytes << " of " << fullSize << " bytes (" << (fullSize > 0 ? 100 * song.numRunningStatusBytes / fullSize : 0) << "%)." << endl;
+		}
 		cout << endl;
 	}
 
-	end(errorStatus);
+	displayRenderCacheStatistics();
+
+	end(song.errorStatus);
 }